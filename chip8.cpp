@@ -2,10 +2,19 @@
  * A chip-8 emulator/interpreter
  */
 #include <cstdint>
+#include <cstddef>
 #include <array>
-#include <functional>
+#include <bitset>
+#include <algorithm>
 #include <map>
-#include <random>
+#include <vector>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef CHIP8_PROFILE
+#include <chrono>
+#include <unordered_map>
+#endif
 
 // The chip-8 includes a builtin 4x5 hex font.
 #define FONT {\
@@ -27,11 +36,75 @@
     0xF0,0x80,0xF0,0x80,0x80 /*F*/\
 }
 
+// SplitMix64, whose state is a single word so that
+// it can be saved and restored along with memory.
+struct SplitMix64 {
+    uint64_t state = 0;
+
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        return z ^ (z >> 31);
+    }
+
+    bool operator==(const SplitMix64&) const = default;
+};
+
+// FNV-1a, which can be chained by passing the previous hash back in
+static uint64_t fnv1a(const uint8_t* data, size_t size, 
+                      uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#ifdef CHIP8_PROFILE
+// Gathered on every instruction by profiling builds (-DCHIP8_PROFILE)
+struct Chip8Profile {
+    std::vector<uint64_t> pc_counts = std::vector<uint64_t>(4096);
+    // Every distinct call stack seen, each being a call to stack_addr 
+    // from its parent stack, with stack 0 the top level. Counts are of
+    // the instructions run directly in each.
+    std::vector<uint32_t> stack_parent  = {0};
+    std::vector<uint16_t> stack_addr    = {0};
+    std::vector<uint8_t>  stack_depth   = {0};
+    std::vector<uint64_t> stack_counts  = {0};
+    uint32_t              current_stack = 0;
+    // Each stack's index, keyed by its parent's index shifted 
+    // above the address called, so CALLs can find it quickly
+    std::unordered_map<uint64_t, uint32_t> stack_children;
+
+    uint64_t                              key_waits = 0;
+    std::chrono::steady_clock::duration   key_wait_time{};
+    std::chrono::steady_clock::time_point wait_start;
+};
+#endif
+
 class Chip8Cpu {
     static constexpr uint8_t  WIDTH  = 64;
     static constexpr uint8_t  HEIGHT = 32;
     // Bytes 0 - 0x200 are reserved for the interpreter
     static constexpr uint16_t PROG_START = 0x200; 
+    // Limits on the decoded block cache
+    static constexpr uint8_t  MAX_BLOCK_LENGTH = 32;
+    static constexpr uint32_t MAX_CACHED_OPS   = 0x8000;
+    // Outside of the range of PC
+    static constexpr uint32_t NO_BREAKPOINT    = 0x10000;
+    // Calls nest this deep before the stack wraps around
+    static constexpr uint8_t  STACK_DEPTH      = 12;
+
+    // An instruction with its operands extracted ahead of time
+    struct Op;
+    using Handler = void (*)(Chip8Cpu&, const Op&);
+    struct Op {
+        Handler  exec;
+        uint16_t opcode;
+        uint16_t nnn;
+        uint8_t  x, y, n, kk;
+    };
+
     union {
         std::array<uint8_t, 4096> memory = {0};
 
@@ -53,12 +126,44 @@ class Chip8Cpu {
             uint8_t key_reg;
         } res;
     };
-    std::mt19937 rnd{};
+    SplitMix64 rnd{};
     uint32_t bg_colour = 0x000000;
     uint32_t fg_colour = 0xFFFFFF;
+    // One bit per display row changed since update_display_buffer
+    uint32_t dirty_rows = ~0u;
+
+    // Straight-line runs of decoded ops, keyed by the address of their
+    // first instruction. Each entry packs the block's index into op_pool
+    // above its length, and a length of 0 means nothing is cached there.
+    std::vector<uint32_t> block_table = std::vector<uint32_t>(4096);
+    std::vector<Op>       op_pool;
+    // Bytes of memory which are covered by a cached block
+    std::bitset<4096>     code_map;
+    // Bumped whenever the whole cache is flushed
+    uint32_t              cache_generation = 0;
+
+    // Execution counts indexed by opcode, empty unless enabled
+    std::vector<uint64_t> opcode_counts;
+    // run() stops before executing the instruction here
+    uint32_t              breakpoint = NO_BREAKPOINT;
+
+#ifdef CHIP8_PROFILE
+    Chip8Profile          profile;
+#endif
+
+    friend class Chip8Jit;
 
 public:
+    // Everything needed to resume emulation later
+    struct State {
+        std::array<uint8_t, 4096> memory;
+        uint64_t                  rng;
+    };
+
     Chip8Cpu() {
+#ifdef CHIP8_PROFILE
+        enable_opcode_counts();
+#endif
         res.PC = PROG_START;
         // Load the font
         int offset = 0;
@@ -68,6 +173,7 @@ public:
     }
 
     void load_ROM(auto& file, auto&& not_empty, auto&& readbyte) {
+        flush_blocks();
         for (int i = PROG_START; not_empty(file); ++i) {
             memory[i] = readbyte(file);
         }
@@ -81,6 +187,9 @@ public:
         if (val == 1 && res.waiting) {
             res.waiting = 0;
             res.V[res.key_reg] = key;
+#ifdef CHIP8_PROFILE
+            profile.key_wait_time += std::chrono::steady_clock::now() - profile.wait_start;
+#endif
         }
     }
 
@@ -94,34 +203,379 @@ public:
         res.sound_timer -= std::min(1, (int) res.sound_timer);
     }
 
+    State save_state() const {
+        return State{memory, rnd.state};
+    }
+
+    void load_state(const State& state) {
+        // Cached blocks stay valid if none of the code they came from differs,
+        // which is the usual case when switching between runs of one ROM
+        bool code_changed = false;
+        for (unsigned addr = PROG_START; addr < memory.size() && !code_changed; ++addr) {
+            code_changed = code_map[addr] && memory[addr] != state.memory[addr];
+        }
+        memory     = state.memory;
+        rnd.state  = state.rng;
+        dirty_rows = ~0u;
+        if (code_changed) {
+            flush_blocks();
+        }
+    }
+
+    uint64_t hash_display() const {
+        return fnv1a(res.display.data(), res.display.size());
+    }
+
+    // Covers everything in State, so equal hashes mean identical runs
+    uint64_t hash_state() const {
+        uint64_t rng = rnd.state;
+        return fnv1a(reinterpret_cast<const uint8_t*>(&rng), sizeof(rng), 
+                     fnv1a(memory.data(), memory.size()));
+    }
+
+    void seed_rng(uint64_t seed) {
+        rnd.state = seed;
+    }
+
+    bool get_pixel(uint8_t x, uint8_t y) const {
+        int index = x + y * WIDTH;
+        // Isolate the bit at the given index
+        return (res.display[index / 8] >> (7 - index % 8)) & 1;
+    }
+
     std::array<uint32_t, WIDTH*HEIGHT> get_display_buffer() const {
         std::array<uint32_t, WIDTH*HEIGHT> buf;
 
-        for (int x = 0; x < WIDTH; ++x) 
         for (int y = 0; y < HEIGHT; ++y) {
-            int index = x + y * WIDTH;
-            // Isolate the bit at the given index
-            uint8_t val = (res.display[index / 8] >> (7 - index % 8)) & 1;
-
-            uint32_t pixel;
-            if (val) pixel = fg_colour;
-            else     pixel = bg_colour;
-
-            buf[index] = 0xFF000000 | pixel;
+            expand_row(y, &buf[y * WIDTH]);
         }
-        
         return buf;
     }
 
+    // Brings buf up to date with the display, only converting the rows
+    // which have changed since the last call. Returns whether any had.
+    bool update_display_buffer(std::array<uint32_t, WIDTH*HEIGHT>& buf) {
+        if (!dirty_rows) {
+            return false;
+        }
+        for (int y = 0; y < HEIGHT; ++y) {
+            if (dirty_rows >> y & 1) expand_row(y, &buf[y * WIDTH]);
+        }
+        dirty_rows = 0;
+        return true;
+    }
+
+    uint16_t get_PC() const {
+        return res.PC;
+    }
+
+    // True when spinning on a jump to itself, which
+    // is how many ROMs (test ROMs especially) finish.
+    bool is_idle() const {
+        uint16_t opcode = (memory[res.PC & 0xFFF] << 8) + memory[(res.PC + 1) & 0xFFF];
+        return opcode == (0x1000 | res.PC);
+    }
+
+    void set_breakpoint(uint16_t addr) {
+        breakpoint = addr;
+    }
+
+    bool at_breakpoint() const {
+        return res.PC == breakpoint;
+    }
+
+    void enable_opcode_counts() {
+        opcode_counts.assign(0x10000, 0);
+    }
+
+    const std::vector<uint64_t>& get_opcode_counts() const {
+        return opcode_counts;
+    }
+
+#ifdef CHIP8_PROFILE
+    const Chip8Profile& get_profile() const {
+        return profile;
+    }
+#endif
+
     void next_instruction() {
+        const Op* block = find_block(res.PC);
+        if (block) {
+            count_ops(block, 1);
+            execute(block[0]);
+        } else {
+            interpret_instruction();
+        }
+    }
+
+    // Execute up to max_ops instructions a block at a time, stopping
+    // early if the CPU starts waiting on a key or reaches the
+    // breakpoint. Returns the number run.
+    unsigned run(unsigned max_ops) {
+        unsigned executed = 0;
+        while (executed < max_ops && !is_waiting() && !at_breakpoint()) {
+            const Op* block = find_block(res.PC);
+            if (!block) {
+                next_instruction();
+                ++executed;
+                continue;
+            }
+            unsigned length = std::min<unsigned>(
+                length_to_breakpoint(block_table[res.PC] & 0xFF), max_ops - executed);
+            count_ops(block, length);
+            for (unsigned i = 0; i < length; ++i) {
+                execute(block[i]);
+            }
+            executed += length;
+        }
+        return executed;
+    }
+
+private:
+    // Converts a row of display bits into ARGB pixels, with the leftmost
+    // pixel in the high bit. Each byte is broadcast across lanes and
+    // compared against per-lane bit masks to select the colour.
+    void expand_row(int y, uint32_t* out) const {
+        const uint8_t* bits = &res.display[y * WIDTH / 8];
+        uint32_t bg = 0xFF000000 | bg_colour;
+        uint32_t fg = 0xFF000000 | fg_colour;
+#if defined(__AVX2__)
+        __m256i bgv  = _mm256_set1_epi32(bg);
+        __m256i diff = _mm256_set1_epi32(fg ^ bg);
+        __m256i mask = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+        for (int i = 0; i < WIDTH / 8; ++i) {
+            __m256i set = _mm256_cmpeq_epi32(
+                _mm256_and_si256(_mm256_set1_epi32(bits[i]), mask), mask);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 8),
+                _mm256_xor_si256(bgv, _mm256_and_si256(set, diff)));
+        }
+#elif defined(__SSE2__)
+        __m128i bgv   = _mm_set1_epi32(bg);
+        __m128i diff  = _mm_set1_epi32(fg ^ bg);
+        __m128i high  = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+        __m128i low   = _mm_setr_epi32(0x8,  0x4,  0x2,  0x1);
+        for (int i = 0; i < WIDTH / 8; ++i) {
+            __m128i byte = _mm_set1_epi32(bits[i]);
+            __m128i set0 = _mm_cmpeq_epi32(_mm_and_si128(byte, high), high);
+            __m128i set1 = _mm_cmpeq_epi32(_mm_and_si128(byte, low),  low);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 8),
+                _mm_xor_si128(bgv, _mm_and_si128(set0, diff)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 8 + 4),
+                _mm_xor_si128(bgv, _mm_and_si128(set1, diff)));
+        }
+#else
+        for (int x = 0; x < WIDTH; ++x) {
+            out[x] = (bits[x / 8] >> (7 - x % 8)) & 1 ? fg : bg;
+        }
+#endif
+    }
+
+    // Fetch, decode and execute one instruction, bypassing the block cache
+    void interpret_instruction() {
         uint8_t opcode_byte_0 = memory[ res.PC      & 0xFFF];
         uint8_t opcode_byte_1 = memory[(res.PC + 1) & 0xFFF];
         uint16_t opcode       = (opcode_byte_0 << 8) + opcode_byte_1;
+        Op op = decode(opcode);
+        count_ops(&op, 1);
+        execute(op);
+    }
+
+    void execute(const Op& op) {
         res.PC += 2;
-        do_instruction(opcode);
+        op.exec(*this, op);
+    }
+
+    // Called with PC at ops[0], just before they all run
+    void count_ops(const Op* ops, unsigned length) {
+#ifdef CHIP8_PROFILE
+        profile_ops(ops, length);
+#endif
+        if (opcode_counts.empty()) {
+            return;
+        }
+        for (unsigned i = 0; i < length; ++i) {
+            ++opcode_counts[ops[i].opcode];
+        }
+    }
+
+#ifdef CHIP8_PROFILE
+    void profile_ops(const Op* ops, unsigned length) {
+        for (unsigned i = 0; i < length; ++i) {
+            ++profile.pc_counts[(res.PC + 2 * i) & 0xFFF];
+            ++profile.stack_counts[profile.current_stack];
+
+            // Follow CALL and RET (which end blocks, so come last) to know
+            // the stack the next instructions run under
+            uint16_t opcode = ops[i].opcode;
+            uint32_t stack  = profile.current_stack;
+            if (opcode == 0x00EE) {
+                profile.current_stack = profile.stack_parent[stack];
+            } else if ((opcode & 0xF000) == 0x2000 && profile.stack_depth[stack] < STACK_DEPTH) {
+                profile.current_stack = enter_stack(stack, opcode & 0xFFF);
+            } else if ((opcode & 0xF0FF) == 0xF00A) {
+                ++profile.key_waits;
+                profile.wait_start = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+    uint32_t enter_stack(uint32_t parent, uint16_t addr) {
+        auto [child, added] = profile.stack_children.try_emplace(
+            uint64_t(parent) << 16 | addr, profile.stack_parent.size());
+        if (!added) {
+            return child->second;
+        }
+        profile.stack_parent.push_back(parent);
+        profile.stack_addr.push_back(addr);
+        profile.stack_depth.push_back(profile.stack_depth[parent] + 1);
+        profile.stack_counts.push_back(0);
+        return profile.stack_parent.size() - 1;
+    }
+#endif
+
+    // How much of the block of length starting at PC can run before
+    // reaching the breakpoint. Always at least one instruction, so a
+    // breakpoint falling between instructions can't stall the CPU.
+    unsigned length_to_breakpoint(unsigned length) const {
+        if (breakpoint > res.PC && breakpoint < res.PC + length * 2u) {
+            return std::max(1u, (breakpoint - res.PC) / 2u);
+        }
+        return length;
+    }
+
+    // Returns the cached block starting at addr, translating it if it
+    // isn't cached yet, or nullptr if addr can't be cached.
+    const Op* find_block(uint16_t addr) {
+        // Code below PROG_START overlaps the registers, which change constantly
+        if (addr < PROG_START || addr > 0xFFE) {
+            return nullptr;
+        }
+        uint32_t entry = block_table[addr];
+        if (!(entry & 0xFF)) {
+            entry = translate_block(addr);
+        }
+        return &op_pool[entry >> 8];
+    }
+
+    uint32_t translate_block(uint16_t addr) {
+        if (op_pool.size() + MAX_BLOCK_LENGTH > MAX_CACHED_OPS) {
+            flush_blocks();
+        }
+        uint32_t first  = op_pool.size();
+        uint32_t length = 0;
+
+        // Decode until something which could leave the block or
+        // modify memory, or until the end of memory
+        for (uint16_t pc = addr; pc < 0xFFF && length < MAX_BLOCK_LENGTH; pc += 2) {
+            uint16_t opcode = (memory[pc] << 8) + memory[pc + 1];
+            op_pool.push_back(decode(opcode));
+            code_map[pc] = code_map[pc + 1] = true;
+            ++length;
+            if (ends_block(opcode)) {
+                break;
+            }
+        }
+        return block_table[addr] = (first << 8) | length;
+    }
+
+    void flush_blocks() {
+        std::fill(block_table.begin(), block_table.end(), 0);
+        op_pool.clear();
+        code_map.reset();
+        ++cache_generation;
+    }
+
+    // All stores to memory by instructions go through here, so
+    // that any cached blocks covering the address are dropped.
+    void write_memory(uint16_t addr, uint8_t val) {
+        addr &= 0xFFF;
+        memory[addr] = val;
+
+        unsigned display_offset = addr - offsetof(Chip8Cpu, res.display);
+        if (display_offset < res.display.size()) {
+            dirty_rows |= 1u << (display_offset * 8 / WIDTH);
+        }
+        if (!code_map[addr]) {
+            return;
+        }
+        // A block covering addr must start less than MAX_BLOCK_LENGTH
+        // instructions before it. code_map is left set, which at worst
+        // makes later stores to addr scan again.
+        int lowest = std::max<int>(PROG_START, addr - MAX_BLOCK_LENGTH * 2 + 1);
+        for (int start = lowest; start <= addr; ++start) {
+            uint32_t length = block_table[start] & 0xFF;
+            if (addr < start + length * 2) {
+                block_table[start] = 0;
+            }
+        }
+    }
+
+public:
+    // The name of an instruction as written in assembly, without its operands filled in
+    static const char* mnemonic(uint16_t opcode) {
+        static const char* arithmetic[16] = {
+            "LD Vx, Vy",   "OR Vx, Vy",  "AND Vx, Vy", "XOR Vx, Vy", 
+            "ADD Vx, Vy",  "SUB Vx, Vy", "SHR Vx",     "SUBN Vx, Vy",
+            nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "SHL Vx", nullptr
+        };
+        const char* name = nullptr;
+        switch (opcode >> 12) {
+        case 0x0: 
+            name = opcode == 0x00E0 ? "CLS" : opcode == 0x00EE ? "RET" : "SYS addr"; 
+            break;
+        case 0x1: name = "JP addr";            break;
+        case 0x2: name = "CALL addr";          break;
+        case 0x3: name = "SE Vx, byte";        break;
+        case 0x4: name = "SNE Vx, byte";       break;
+        case 0x5: name = "SE Vx, Vy";          break;
+        case 0x6: name = "LD Vx, byte";        break;
+        case 0x7: name = "ADD Vx, byte";       break;
+        case 0x8: name = arithmetic[opcode & 0xF]; break;
+        case 0x9: name = "SNE Vx, Vy";         break;
+        case 0xA: name = "LD I, addr";         break;
+        case 0xB: name = "JP V0, addr";        break;
+        case 0xC: name = "RND Vx, byte";       break;
+        case 0xD: name = "DRW Vx, Vy, nibble"; break;
+        case 0xE: 
+            if ((opcode & 0xFF) == 0x9E) name = "SKP Vx";
+            if ((opcode & 0xFF) == 0xA1) name = "SKNP Vx";
+            break;
+        case 0xF: 
+            switch (opcode & 0xFF) {
+            case 0x07: name = "LD Vx, DT";   break;
+            case 0x0A: name = "LD Vx, K";    break;
+            case 0x15: name = "LD DT, Vx";   break;
+            case 0x18: name = "LD ST, Vx";   break;
+            case 0x1E: name = "ADD I, Vx";   break;
+            case 0x29: name = "LD F, Vx";    break;
+            case 0x33: name = "LD B, Vx";    break;
+            case 0x55: name = "LD [I], Vx";  break;
+            case 0x65: name = "LD Vx, [I]";  break;
+            }
+            break;
+        }
+        return name ? name : "unknown";
     }
 
 private:
+    static bool ends_block(uint16_t opcode) {
+        switch (opcode >> 12) {
+        case 0x0: return opcode == 0x00EE; // RET
+        case 0x1: case 0x2: case 0xB:      // Jumps and calls
+        case 0x3: case 0x4: case 0x5:      // Skips
+        case 0x9: case 0xE:
+            return true;
+        case 0xF: 
+            switch (opcode & 0xFF) {
+            case 0x0A: // LD Vx, K
+            case 0x33: // LD B, Vx
+            case 0x55: // LD [I], Vx
+                return true;
+            }
+        }
+        return false;
+    }
+
     void draw_sprite(uint8_t regx, uint8_t regy, uint8_t num_bytes) {
         uint8_t x   = res.V[regx];
         uint8_t y   = res.V[regy];
@@ -133,6 +587,7 @@ private:
             uint8_t iy = (y + byteoffset) % HEIGHT;
             uint8_t index = (ix + iy * WIDTH) / 8;
             uint8_t prev_byte = res.display[index];
+            dirty_rows |= 1u << iy;
 
             res.display[index] ^= new_byte;
 
@@ -150,228 +605,1754 @@ private:
         res.V[0xF] = erased;
     }
 
-    void do_instruction(uint16_t opcode) {
+#define OP []([[maybe_unused]] Chip8Cpu& cpu, [[maybe_unused]] const Op& op)
+    static Op decode(uint16_t opcode) {
+        Op op;
+        op.opcode = opcode;
         // Variables used by the instructions
-        uint16_t nnn = opcode & 0xFFF;
-        uint8_t  n   = opcode & 0xF;
-        uint8_t  x   = (opcode >> 8) & 0xF;
-        uint8_t  y   = (opcode >> 4) & 0xF;
-        uint8_t  kk  = opcode & 0xFF;
+        op.nnn = opcode & 0xFFF;
+        op.n   = opcode & 0xF;
+        op.x   = (opcode >> 8) & 0xF;
+        op.y   = (opcode >> 4) & 0xF;
+        op.kk  = opcode & 0xFF;
 
         // Main identifying part of the opcode
         uint8_t high_nybble = opcode >> 12;
 
         // Use tables to retrieve instructions based on their opcode
-        using OpTable = std::map<uint8_t, std::function<void()>>;
+        using OpTable = std::map<uint8_t, Handler>;
         
         // Ops with high nybble 0
-        static OpTable sub_ops_0 = {
-            { 0xEE,  [&]() { res.PC = res.stack[res.SP-- % 12]; } }, // RET
-            { 0xE0,  [&]() { std::fill(res.display.begin(),          // CLS
-                                       res.display.end(), 0); } },
+        static const OpTable sub_ops_0 = {
+            { 0xEE,  OP { cpu.res.PC = cpu.res.stack[cpu.res.SP-- % STACK_DEPTH]; } }, // RET
+            { 0xE0,  OP {                                                     // CLS
+                std::fill(cpu.res.display.begin(), cpu.res.display.end(), 0); 
+                cpu.dirty_rows = ~0u;
+            }},
         };
 
         // Ops with high nybble 8: various arithmetic operations
-        static OpTable sub_ops_8 = {
-            { 0x0,  [&](){ res.V[x] =  res.V[y]; }}, // LD Vx, byte 
-            { 0x1,  [&](){ res.V[x] |= res.V[y]; }}, // OR Vx, Vy
-            { 0x2,  [&](){ res.V[x] &= res.V[y]; }}, // AND Vx, Vy
-            { 0x3,  [&](){ res.V[x] ^= res.V[y]; }}, // XOR Vx, Vy
-            { 0x4,  [&](){ // ADD Vx, Vy
-                uint16_t val = res.V[x] + res.V[y];
-                res.V[0xF] = val > 255;
-                res.V[x]   = val & 0xFF;
+        static const OpTable sub_ops_8 = {
+            { 0x0,  OP { cpu.res.V[op.x] =  cpu.res.V[op.y]; }}, // LD Vx, byte 
+            { 0x1,  OP { cpu.res.V[op.x] |= cpu.res.V[op.y]; }}, // OR Vx, Vy
+            { 0x2,  OP { cpu.res.V[op.x] &= cpu.res.V[op.y]; }}, // AND Vx, Vy
+            { 0x3,  OP { cpu.res.V[op.x] ^= cpu.res.V[op.y]; }}, // XOR Vx, Vy
+            { 0x4,  OP { // ADD Vx, Vy
+                uint16_t val = cpu.res.V[op.x] + cpu.res.V[op.y];
+                cpu.res.V[0xF]  = val > 255;
+                cpu.res.V[op.x] = val & 0xFF;
             }},
-            { 0x5,  [&](){ // SUB Vx, Vy
-                res.V[0xF] =  res.V[x] > res.V[y];
-                res.V[x]   -= res.V[y];
+            { 0x5,  OP { // SUB Vx, Vy
+                cpu.res.V[0xF]  =  cpu.res.V[op.x] > cpu.res.V[op.y];
+                cpu.res.V[op.x] -= cpu.res.V[op.y];
             }},
-            { 0x6,  [&](){ // SHR Vx {, Vy}
-                res.V[0xF] =   res.V[x] & 1;
-                res.V[x]   >>= 1;
+            { 0x6,  OP { // SHR Vx {, Vy}
+                cpu.res.V[0xF]  =   cpu.res.V[op.x] & 1;
+                cpu.res.V[op.x] >>= 1;
             }},
-            { 0x7,  [&](){ // SUBN Vx, Vy
-                res.V[0xF] = res.V[x] < res.V[y];
-                res.V[x]   = res.V[y] - res.V[x];
+            { 0x7,  OP { // SUBN Vx, Vy
+                cpu.res.V[0xF]  = cpu.res.V[op.x] < cpu.res.V[op.y];
+                cpu.res.V[op.x] = cpu.res.V[op.y] - cpu.res.V[op.x];
             }},                                       
-            { 0xE,  [&](){ // SNE Vx, Vy
-                res.V[0xF] =   res.V[x] >> 7;
-                res.V[x]   <<= 1;
+            { 0xE,  OP { // SHL Vx {, Vy}
+                cpu.res.V[0xF]  =   cpu.res.V[op.x] >> 7;
+                cpu.res.V[op.x] <<= 1;
             }}
         };
 
         // Ops with high nybble E: Keyboard conditional skips
-        static OpTable sub_ops_E = {
-            { 0x9E,  [&](){ if (res.keyboard[res.V[x]])  res.PC += 2; }}, // SKP Vx
-            { 0xA1,  [&](){ if (!res.keyboard[res.V[x]]) res.PC += 2; }}  // SKNP Vx
+        static const OpTable sub_ops_E = {
+            { 0x9E,  OP { if (cpu.res.keyboard[cpu.res.V[op.x]])  cpu.res.PC += 2; }}, // SKP Vx
+            { 0xA1,  OP { if (!cpu.res.keyboard[cpu.res.V[op.x]]) cpu.res.PC += 2; }}  // SKNP Vx
         };
 
         // Ops with high nybble F: Various loading & storing operations
-        static OpTable sub_ops_F = {
-            { 0x07,  [&](){ res.V[x] = res.delay_timer; }}, // LD Vx, DT
-            { 0x0A,  [&](){                                 // LD Vx, K
-                res.waiting = 1; 
-                res.key_reg = x;
+        static const OpTable sub_ops_F = {
+            { 0x07,  OP { cpu.res.V[op.x] = cpu.res.delay_timer; }}, // LD Vx, DT
+            { 0x0A,  OP {                                            // LD Vx, K
+                cpu.res.waiting = 1; 
+                cpu.res.key_reg = op.x;
             }},
-            { 0x15,  [&](){ res.delay_timer = res.V[x]; }}, // LD DT, Vx
-            { 0x18,  [&](){ res.sound_timer = res.V[x]; }}, // LD ST, Vx
-            { 0x1E,  [&](){ res.I += res.V[x]; }},          // ADD I, Vx
-            { 0x29,  [&](){                                 // LD F, Vx
-                res.I = offsetof(Chip8Cpu, res.font) + (res.V[x] & 0xF) * 5;
+            { 0x15,  OP { cpu.res.delay_timer = cpu.res.V[op.x]; }}, // LD DT, Vx
+            { 0x18,  OP { cpu.res.sound_timer = cpu.res.V[op.x]; }}, // LD ST, Vx
+            { 0x1E,  OP { cpu.res.I += cpu.res.V[op.x]; }},          // ADD I, Vx
+            { 0x29,  OP {                                            // LD F, Vx
+                cpu.res.I = offsetof(Chip8Cpu, res.font) + (cpu.res.V[op.x] & 0xF) * 5;
             }},
-            { 0x33,  [&](){ // LD B, Vx
-                memory[res.I       & 0xFFF] = (res.V[x] / 100) % 10;
-                memory[(res.I + 1) & 0xFFF] = (res.V[x] / 10)  % 10;
-                memory[(res.I + 2) & 0xFFF] =  res.V[x]        % 10;
+            { 0x33,  OP { // LD B, Vx
+                uint8_t val = cpu.res.V[op.x];
+                cpu.write_memory(cpu.res.I,     (val / 100) % 10);
+                cpu.write_memory(cpu.res.I + 1, (val / 10)  % 10);
+                cpu.write_memory(cpu.res.I + 2,  val        % 10);
             }},
-            { 0x55,  [&](){ // LD [I], Vx
-                for (uint8_t i = 0; i <= x; ++i) 
-                    memory[(res.I + i) & 0xFFF] = res.V[i]; 
+            { 0x55,  OP { // LD [I], Vx
+                for (uint8_t i = 0; i <= op.x; ++i) 
+                    cpu.write_memory(cpu.res.I + i, cpu.res.V[i]); 
             }},
-            { 0x65,  [&](){ // LD Vx, [I]
-                for (uint8_t i = 0; i <= x; ++i)             
-                    res.V[i] = memory[(res.I + i) & 0xFFF];
+            { 0x65,  OP { // LD Vx, [I]
+                for (uint8_t i = 0; i <= op.x; ++i)             
+                    cpu.res.V[i] = cpu.memory[(cpu.res.I + i) & 0xFFF];
             }}
         };
 
-        static OpTable main_ops = {
+        static const OpTable main_ops = {
             /* Jumping */
-            { 0x1,  [&](){ res.PC = nnn; }},            // JP addr
-            { 0xB,  [&](){ res.PC = nnn + res.V[0]; }}, // JP V0, addr
-            { 0x2,  [&](){                              // CALL addr
-                res.stack[++res.SP % 12] = res.PC; 
-                res.PC = nnn;
+            { 0x1,  OP { cpu.res.PC = op.nnn; }},                // JP addr
+            { 0xB,  OP { cpu.res.PC = op.nnn + cpu.res.V[0]; }}, // JP V0, addr
+            { 0x2,  OP {                                         // CALL addr
+                cpu.res.stack[++cpu.res.SP % STACK_DEPTH] = cpu.res.PC; 
+                cpu.res.PC = op.nnn;
             }},
             /* Skipping */
-            { 0x3,  [&](){ if (res.V[x] == kk)       res.PC += 2; }}, // SE Vx, byte
-            { 0x4,  [&](){ if (res.V[x] != kk)       res.PC += 2; }}, // SNE Vx, byte
-            { 0x5,  [&](){ if (res.V[x] == res.V[y]) res.PC += 2; }}, // SE Vx, Vy
-            { 0x9,  [&](){ if (res.V[x] != res.V[y]) res.PC += 2; }}, // SNE Vx, Vy
+            { 0x3,  OP { if (cpu.res.V[op.x] == op.kk)           cpu.res.PC += 2; }}, // SE Vx, byte
+            { 0x4,  OP { if (cpu.res.V[op.x] != op.kk)           cpu.res.PC += 2; }}, // SNE Vx, byte
+            { 0x5,  OP { if (cpu.res.V[op.x] == cpu.res.V[op.y]) cpu.res.PC += 2; }}, // SE Vx, Vy
+            { 0x9,  OP { if (cpu.res.V[op.x] != cpu.res.V[op.y]) cpu.res.PC += 2; }}, // SNE Vx, Vy
             /* Immediate loading */
-            { 0x6,  [&](){ res.V[x] =  kk; }},  // LD Vx, byte
-            { 0x7,  [&](){ res.V[x] += kk; }},  // ADD Vx, byte
-            { 0xA,  [&](){ res.I    =  nnn; }}, // LD I, addr
+            { 0x6,  OP { cpu.res.V[op.x] =  op.kk; }},  // LD Vx, byte
+            { 0x7,  OP { cpu.res.V[op.x] += op.kk; }},  // ADD Vx, byte
+            { 0xA,  OP { cpu.res.I       =  op.nnn; }}, // LD I, addr
             /* Other */
-            { 0xD,  [&](){ draw_sprite(x, y, n); }}, // DRW Vx, Vy, nibble
-            { 0xC,  [&](){                           // RND Vx, byte
-                uint8_t num = std::uniform_int_distribution<>(0, 255)(rnd);
-                res.V[x]    = num & kk;
+            { 0xD,  OP { cpu.draw_sprite(op.x, op.y, op.n); }}, // DRW Vx, Vy, nibble
+            { 0xC,  OP {                                        // RND Vx, byte
+                uint8_t num     = cpu.rnd() >> 56;
+                cpu.res.V[op.x] = num & op.kk;
             }}, 
-            /* Operations which share a highest nybble */
-            { 0x0,  [&](){ sub_ops_0[kk](); }},
-            { 0x8,  [&](){ sub_ops_8[n](); }},                        
-            { 0xE,  [&](){ sub_ops_E[kk](); }},              
-            { 0xF,  [&](){ sub_ops_F[kk](); }},
         };
 
-        main_ops[high_nybble]();
+        // Unknown opcodes (including SYS addr) do nothing
+        auto find = [](const OpTable& table, uint8_t key) -> Handler {
+            auto iter = table.find(key);
+            if (iter == table.end()) 
+                return OP {};
+            return iter->second;
+        };
+
+        /* Operations which share a highest nybble */
+        switch (high_nybble) {
+        case 0x0: op.exec = find(sub_ops_0, op.kk);      break;
+        case 0x8: op.exec = find(sub_ops_8, op.n);       break;
+        case 0xE: op.exec = find(sub_ops_E, op.kk);      break;
+        case 0xF: op.exec = find(sub_ops_F, op.kk);      break;
+        default:  op.exec = find(main_ops, high_nybble); break;
+        }
+        return op;
     }
+#undef OP
 };
 
 
 
-#include <SDL2/SDL.h>
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT
+#include <sys/mman.h>
+#include <cstring>
 #include <iostream>
-#include <chrono>
-#include <fstream>
+#include <memory>
 
-static void handle_events(Chip8Cpu& cpu, bool& running) {
-    std::map<int, uint8_t> key_to_offset = {
-        {SDLK_1, 0x1}, {SDLK_2, 0x2}, {SDLK_3, 0x3}, {SDLK_4, 0xC},
-        {SDLK_q, 0x4}, {SDLK_w, 0x5}, {SDLK_e, 0x6}, {SDLK_r, 0xD},
-        {SDLK_a, 0x7}, {SDLK_s, 0x8}, {SDLK_d, 0x9}, {SDLK_f, 0xE},
-        {SDLK_z, 0xA}, {SDLK_x, 0x0}, {SDLK_c, 0xB}, {SDLK_v, 0xF}
+// Compiles the interpreter's cached blocks into x86-64 code.
+// The V registers used most by a block are kept in host registers
+// while it runs, and ops which aren't worth compiling (drawing, key
+// waits, stores, calls...) call back into the interpreter's handlers.
+class Chip8Jit {
+    using Op      = Chip8Cpu::Op;
+    using BlockFn = void (*)(Chip8Cpu*);
+
+    static constexpr size_t CODE_SIZE      = 1 << 20;
+    // Enough room for the largest block this can emit
+    static constexpr size_t MAX_BLOCK_CODE = 1 << 14;
+
+    // Host registers (by x86 encoding) available to hold V registers.
+    // rbx holds the Chip8Cpu pointer and rax, rcx, rdx are scratch.
+    static constexpr std::array<uint8_t, 11> HOST_REGS = {
+        5, 12, 13, 14, 15, 6, 7, 8, 9, 10, 11
     };
-    
-    SDL_Event event;
+    enum : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3 };
+    // rbx, rbp and r12 - r15, which blocks must preserve
+    static constexpr std::array<uint8_t, 6> SAVED_REGS = {3, 5, 12, 13, 14, 15};
+    // Condition codes for setcc/cmovcc
+    enum : uint8_t { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
 
-    while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-        case SDL_KEYDOWN:
-        case SDL_KEYUP: {
-            int sym    = event.key.keysym.sym;
-            bool press = event.type == SDL_KEYDOWN;
+    // Offsets of the CPU's state from the Chip8Cpu pointer
+    static constexpr int32_t V_OFFSET     = offsetof(Chip8Cpu, res.V);
+    static constexpr int32_t I_OFFSET     = offsetof(Chip8Cpu, res.I);
+    static constexpr int32_t PC_OFFSET    = offsetof(Chip8Cpu, res.PC);
+    static constexpr int32_t DT_OFFSET    = offsetof(Chip8Cpu, res.delay_timer);
+    static constexpr int32_t ST_OFFSET    = offsetof(Chip8Cpu, res.sound_timer);
+    static constexpr int32_t FONT_ADDRESS = offsetof(Chip8Cpu, res.font);
 
-            if (key_to_offset.find(sym) != key_to_offset.end()) {
-                cpu.process_key(key_to_offset[sym], press);
-            }
+    struct NativeBlock {
+        BlockFn  fn;
+        uint32_t block_entry;
+        uint32_t generation;
+    };
 
-            if (sym != SDLK_ESCAPE) {
-                break;
-            }
-            [[fallthrough]];
+    Chip8Cpu& cpu;
+    uint8_t*  code      = nullptr;
+    size_t    code_used = 0;
+    std::vector<NativeBlock> native = std::vector<NativeBlock>(4096);
+
+    // When cross-checking, every native block is also
+    // run on this interpreter and the results compared.
+    std::unique_ptr<Chip8Cpu> reference;
+    unsigned long mismatches = 0;
+
+public:
+    Chip8Jit(Chip8Cpu& c, bool cross_check = false) : cpu(c) {
+        void* mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, 
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            code = static_cast<uint8_t*>(mem);
+        } else {
+            std::cerr << "JIT: unable to map code buffer, interpreting instead\n";
         }
-        case SDL_QUIT:
-            running = false;
-            break;
+        if (cross_check) {
+            reference = std::make_unique<Chip8Cpu>();
         }
     }
-}
 
-int main(int argc, const char** argv) {
-    constexpr int OPS_PER_FRAME = 100;
-    constexpr int FPS           = 60;
-    constexpr int SCREEN_WIDTH  = 640;
-    constexpr int SCREEN_HEIGHT = 320;
+    ~Chip8Jit() {
+        if (code) {
+            munmap(code, CODE_SIZE);
+        }
+    }
 
-    if (argc != 2) {
-        std::cout << "A ROM is required\n";
-        return 1;
+    Chip8Jit(const Chip8Jit&) = delete;
+    Chip8Jit& operator=(const Chip8Jit&) = delete;
+
+    unsigned long get_mismatches() const {
+        return mismatches;
     }
 
-    // Set up CPU
-    Chip8Cpu cpu = Chip8Cpu();
-    std::ifstream file(argv[1], std::ios::binary);
-    cpu.load_ROM(
-        file, 
-        [](auto& file){ return file.good(); }, 
-        [](auto& file){ return file.get(); });
+    // Same contract as Chip8Cpu::run
+    unsigned run(unsigned max_ops) {
+        unsigned executed = 0;
+        while (executed < max_ops && !cpu.is_waiting() && !cpu.at_breakpoint()) {
+            uint16_t  pc    = cpu.res.PC;
+            const Op* block = cpu.find_block(pc);
+            if (!block) {
+                cpu.next_instruction();
+                ++executed;
+                continue;
+            }
+            uint32_t entry  = cpu.block_table[pc];
+            unsigned length = entry & 0xFF;
+            // Blocks only run whole, so let the interpreter finish off
+            if (length > max_ops - executed) {
+                executed += cpu.run(max_ops - executed);
+                break;
+            }
+            BlockFn fn = find_native(pc, entry, block, length);
+            if (!fn || cpu.length_to_breakpoint(length) != length) {
+                executed += cpu.run(length);
+                continue;
+            }
+            cpu.count_ops(block, length);
+            if (reference) {
+                run_checked(fn, pc, length);
+            } else {
+                fn(&cpu);
+            }
+            executed += length;
+        }
+        return executed;
+    }
 
-    // Set up graphics
-    SDL_Window* window = SDL_CreateWindow(
-        "Chip-8", 
-        SDL_WINDOWPOS_CENTERED, 
-        SDL_WINDOWPOS_CENTERED,
-        SCREEN_WIDTH, SCREEN_HEIGHT, 
-        SDL_WINDOW_RESIZABLE);
+private:
+    BlockFn find_native(uint16_t pc, uint32_t entry, const Op* block, unsigned length) {
+        NativeBlock& nb = native[pc];
+        if (nb.fn && nb.block_entry == entry && nb.generation == cpu.cache_generation) {
+            return nb.fn;
+        }
+        if (!code) {
+            return nullptr;
+        }
+        nb = {compile(pc, block, length), entry, cpu.cache_generation};
+        return nb.fn;
+    }
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(
-        window, -1, 0);
+    void run_checked(BlockFn fn, uint16_t pc, unsigned length) {
+        reference->memory = cpu.memory;
+        reference->rnd    = cpu.rnd;
+        fn(&cpu);
+        for (unsigned i = 0; i < length; ++i) {
+            reference->interpret_instruction();
+        }
+        if (reference->memory == cpu.memory && reference->rnd == cpu.rnd) {
+            return;
+        }
+        ++mismatches;
+        for (unsigned addr = 0; addr < cpu.memory.size(); ++addr) {
+            if (reference->memory[addr] != cpu.memory[addr]) {
+                std::cerr << std::hex 
+                          << "JIT mismatch in block 0x" << pc 
+                          << ": memory[0x" << addr << "] is 0x" << +cpu.memory[addr]
+                          << ", interpreter has 0x" << +reference->memory[addr] 
+                          << std::dec << "\n";
+                break;
+            }
+        }
+        // Carry on from the interpreter's state
+        cpu.memory     = reference->memory;
+        cpu.rnd        = reference->rnd;
+        cpu.dirty_rows = ~0u;
+        cpu.flush_blocks();
+    }
 
-    SDL_Texture*  texture  = SDL_CreateTexture(
-        renderer, SDL_PIXELFORMAT_ARGB8888, 
-        SDL_TEXTUREACCESS_STREAMING, 64, 32);
-    
-    bool draw_frame    = false;
-    int  frames_so_far = 0;
-    auto start         = std::chrono::system_clock::now();
+    // x86-64 encoding helpers, only covering the forms used below.
+    // Memory operands are all [rbx + disp32].
+    struct Emitter {
+        std::vector<uint8_t> bytes;
+
+        void byte(uint8_t b) { 
+            bytes.push_back(b); 
+        }
+        void imm16(uint16_t v) { 
+            byte(v); byte(v >> 8); 
+        }
+        void imm32(uint32_t v) { 
+            imm16(v); imm16(v >> 16); 
+        }
+        void imm64(uint64_t v) { 
+            imm32(v); imm32(v >> 32); 
+        }
+        void rex(bool w, uint8_t reg, uint8_t rm, bool force = false) {
+            uint8_t prefix = 0x40 | w << 3 | (reg >> 3) << 2 | (rm >> 3);
+            if (prefix != 0x40 || force) byte(prefix);
+        }
+        void mem(uint8_t reg, int32_t disp) {
+            byte(0x80 | (reg & 7) << 3 | RBX);
+            imm32(disp);
+        }
+        void modrm_reg(uint8_t reg, uint8_t rm) {
+            byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        void mov_r32_r32(uint8_t dst, uint8_t src) {
+            rex(false, src, dst); byte(0x89); modrm_reg(src, dst);
+        }
+        void movzx_r32_r8(uint8_t dst, uint8_t src) {
+            rex(false, dst, src, src >= 4); byte(0x0F); byte(0xB6); modrm_reg(dst, src);
+        }
+        void movzx_r32_m8(uint8_t dst, int32_t disp) {
+            rex(false, dst, 0); byte(0x0F); byte(0xB6); mem(dst, disp);
+        }
+        void movzx_r32_m16(uint8_t dst, int32_t disp) {
+            rex(false, dst, 0); byte(0x0F); byte(0xB7); mem(dst, disp);
+        }
+        void mov_m8_r8(int32_t disp, uint8_t src) {
+            rex(false, src, 0, src >= 4); byte(0x88); mem(src, disp);
+        }
+        void mov_m16_r16(int32_t disp, uint8_t src) {
+            byte(0x66); rex(false, src, 0); byte(0x89); mem(src, disp);
+        }
+        void mov_m8_imm8(int32_t disp, uint8_t imm) {
+            byte(0xC6); mem(0, disp); byte(imm);
+        }
+        void mov_m16_imm16(int32_t disp, uint16_t imm) {
+            byte(0x66); byte(0xC7); mem(0, disp); imm16(imm);
+        }
+        void mov_r32_imm32(uint8_t dst, uint32_t imm) {
+            rex(false, 0, dst); byte(0xB8 | (dst & 7)); imm32(imm);
+        }
+        void mov_r64_imm64(uint8_t dst, uint64_t imm) {
+            rex(true, 0, dst); byte(0xB8 | (dst & 7)); imm64(imm);
+        }
+        // add = 0x01, or = 0x09, and = 0x21, sub = 0x29, xor = 0x31, cmp = 0x39
+        void alu_r32_r32(uint8_t opcode, uint8_t dst, uint8_t src) {
+            rex(false, src, dst); byte(opcode); modrm_reg(src, dst);
+        }
+        // add = 0, and = 4, cmp = 7
+        void alu_r32_imm32(uint8_t ext, uint8_t dst, uint32_t imm) {
+            rex(false, 0, dst); byte(0x81); modrm_reg(ext, dst); imm32(imm);
+        }
+        // shl = 4, shr = 5
+        void shift_r32_imm8(uint8_t ext, uint8_t dst, uint8_t imm) {
+            rex(false, 0, dst); byte(0xC1); modrm_reg(ext, dst); byte(imm);
+        }
+        void setcc(uint8_t cc, uint8_t dst) {
+            rex(false, 0, dst, dst >= 4); byte(0x0F); byte(0x90 | cc); modrm_reg(0, dst);
+        }
+        void cmovcc(uint8_t cc, uint8_t dst, uint8_t src) {
+            rex(false, dst, src); byte(0x0F); byte(0x40 | cc); modrm_reg(dst, src);
+        }
+        void push(uint8_t reg) {
+            rex(false, 0, reg); byte(0x50 | (reg & 7));
+        }
+        void pop(uint8_t reg) {
+            rex(false, 0, reg); byte(0x58 | (reg & 7));
+        }
+    };
 
-    for (bool running = true; running;) {
-        handle_events(cpu, running);
+    // Per-block compilation state
+    struct BlockCompiler {
+        Emitter e;
+        // Host register holding each V register, or 0 if it stays in memory
+        std::array<uint8_t, 16> host  = {0};
+        std::array<bool, 16>    dirty = {false};
 
-        // Only draw a new frame every 1 / FPS seconds
-        auto now = std::chrono::system_clock::now();
-        std::chrono::duration<double> elapsed_seconds = now - start;
-        draw_frame = int(elapsed_seconds.count() * FPS) - frames_so_far > 0;
+        void load(uint8_t scratch, uint8_t v) {
+            if (host[v]) e.mov_r32_r32(scratch, host[v]);
+            else         e.movzx_r32_m8(scratch, V_OFFSET + v);
+        }
+        void store(uint8_t v, uint8_t scratch) {
+            if (host[v]) {
+                e.movzx_r32_r8(host[v], scratch);
+                dirty[v] = true;
+            } else {
+                e.mov_m8_r8(V_OFFSET + v, scratch);
+            }
+        }
+        void reload_all() {
+            for (uint8_t v = 0; v < 16; ++v) 
+                if (host[v]) e.movzx_r32_m8(host[v], V_OFFSET + v);
+        }
+        void write_back() {
+            for (uint8_t v = 0; v < 16; ++v) {
+                if (host[v] && dirty[v]) e.mov_m8_r8(V_OFFSET + v, host[v]);
+                dirty[v] = false;
+            }
+        }
+        // PC = condition ? skip_to : next
+        void conditional_pc(uint8_t cc, uint16_t next, uint16_t skip_to) {
+            e.mov_r32_imm32(RDX, next);
+            e.mov_r32_imm32(RCX, skip_to);
+            e.cmovcc(cc, RDX, RCX);
+            e.mov_m16_r16(PC_OFFSET, RDX);
+        }
+    };
 
-        if (draw_frame) {
-            ++frames_so_far;
-            cpu.update_timers();
+    // Emits native code for op, returning false if it
+    // should be left to the interpreter's handler instead.
+    static bool compile_op(BlockCompiler& c, const Op& op, uint16_t pc) {
+        Emitter& e = c.e;
+        uint8_t x = op.x, y = op.y;
+        uint16_t next = pc + 2;
 
-            // Copy the display buffer to the screen
-            auto buf = cpu.get_display_buffer();
-            SDL_UpdateTexture(texture, nullptr, &buf, 4*64);
-            SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-            SDL_RenderPresent(renderer);
-        } else {
-            SDL_Delay(1000 / FPS);
+        switch (op.opcode >> 12) {
+        case 0x1: // JP addr
+            e.mov_m16_imm16(PC_OFFSET, op.nnn);
+            return true;
+        case 0xB: // JP V0, addr
+            c.load(RAX, 0);
+            e.alu_r32_imm32(0, RAX, op.nnn);
+            e.mov_m16_r16(PC_OFFSET, RAX);
+            return true;
+        case 0x3: // SE Vx, byte
+        case 0x4: // SNE Vx, byte
+            c.load(RAX, x);
+            e.alu_r32_imm32(7, RAX, op.kk);
+            c.conditional_pc(op.opcode >> 12 == 0x3 ? CC_E : CC_NE, next, next + 2);
+            return true;
+        case 0x5: // SE Vx, Vy
+        case 0x9: // SNE Vx, Vy
+            if (op.n != 0) return false;
+            c.load(RAX, x);
+            c.load(RCX, y);
+            e.alu_r32_r32(0x39, RAX, RCX);
+            c.conditional_pc(op.opcode >> 12 == 0x5 ? CC_E : CC_NE, next, next + 2);
+            return true;
+        case 0x6: // LD Vx, byte
+            if (c.host[x]) {
+                e.mov_r32_imm32(c.host[x], op.kk);
+                c.dirty[x] = true;
+            } else {
+                e.mov_m8_imm8(V_OFFSET + x, op.kk);
+            }
+            return true;
+        case 0x7: // ADD Vx, byte
+            c.load(RAX, x);
+            e.alu_r32_imm32(0, RAX, op.kk);
+            c.store(x, RAX);
+            return true;
+        case 0xA: // LD I, addr
+            e.mov_m16_imm16(I_OFFSET, op.nnn);
+            return true;
+        case 0x8:
+            return compile_arithmetic(c, op);
+        case 0xF:
+            switch (op.kk) {
+            case 0x07: // LD Vx, DT
+                e.movzx_r32_m8(RAX, DT_OFFSET);
+                c.store(x, RAX);
+                return true;
+            case 0x15: // LD DT, Vx
+            case 0x18: // LD ST, Vx
+                c.load(RAX, x);
+                e.mov_m8_r8(op.kk == 0x15 ? DT_OFFSET : ST_OFFSET, RAX);
+                return true;
+            case 0x1E: // ADD I, Vx
+                e.movzx_r32_m16(RAX, I_OFFSET);
+                c.load(RCX, x);
+                e.alu_r32_r32(0x01, RAX, RCX);
+                e.mov_m16_r16(I_OFFSET, RAX);
+                return true;
+            case 0x29: // LD F, Vx
+                c.load(RAX, x);
+                e.alu_r32_imm32(4, RAX, 0xF);
+                e.byte(0x8D); e.byte(0x04); e.byte(0x80); // lea eax, [rax + rax*4]
+                e.alu_r32_imm32(0, RAX, FONT_ADDRESS);
+                e.mov_m16_r16(I_OFFSET, RAX);
+                return true;
+            }
+            return false;
         }
+        return false;
+    }
 
-        if (!cpu.is_waiting()) {
-            for (int _ = 0; _ < OPS_PER_FRAME; ++_) {
-                cpu.next_instruction();
+    // The flag is always written before the result, and the result
+    // re-reads its operands, so that ops using VF match the interpreter.
+    static bool compile_arithmetic(BlockCompiler& c, const Op& op) {
+        Emitter& e = c.e;
+        uint8_t x = op.x, y = op.y;
+
+        switch (op.n) {
+        case 0x0: // LD Vx, Vy
+            c.load(RAX, y);
+            c.store(x, RAX);
+            return true;
+        case 0x1: // OR Vx, Vy
+        case 0x2: // AND Vx, Vy
+        case 0x3: // XOR Vx, Vy
+            c.load(RAX, x);
+            c.load(RCX, y);
+            e.alu_r32_r32(op.n == 0x1 ? 0x09 : op.n == 0x2 ? 0x21 : 0x31, RAX, RCX);
+            c.store(x, RAX);
+            return true;
+        case 0x4: // ADD Vx, Vy
+            c.load(RAX, x);
+            c.load(RCX, y);
+            e.alu_r32_r32(0x01, RAX, RCX);
+            e.alu_r32_imm32(7, RAX, 0xFF);
+            e.setcc(CC_A, RDX);
+            c.store(0xF, RDX);
+            c.store(x, RAX);
+            return true;
+        case 0x5: // SUB Vx, Vy
+        case 0x7: // SUBN Vx, Vy
+            c.load(RAX, x);
+            c.load(RCX, y);
+            e.alu_r32_r32(0x39, RAX, RCX);
+            e.setcc(op.n == 0x5 ? CC_A : CC_B, RDX);
+            c.store(0xF, RDX);
+            c.load(RAX, x);
+            c.load(RCX, y);
+            if (op.n == 0x5) {
+                e.alu_r32_r32(0x29, RAX, RCX);
+                c.store(x, RAX);
+            } else {
+                e.alu_r32_r32(0x29, RCX, RAX);
+                c.store(x, RCX);
             }
+            return true;
+        case 0x6: // SHR Vx {, Vy}
+        case 0xE: // SHL Vx {, Vy}
+            c.load(RDX, x);
+            if (op.n == 0x6) e.alu_r32_imm32(4, RDX, 1);
+            else             e.shift_r32_imm8(5, RDX, 7);
+            c.store(0xF, RDX);
+            c.load(RAX, x);
+            e.shift_r32_imm8(op.n == 0x6 ? 5 : 4, RAX, 1);
+            c.store(x, RAX);
+            return true;
         }
+        return false;
     }
-    SDL_Quit();
-}
+
+    // Which V registers an op compiled natively touches
+    static void count_uses(const Op& op, std::array<unsigned, 16>& uses) {
+        switch (op.opcode >> 12) {
+        case 0xB: 
+            ++uses[0]; 
+            break;
+        case 0x3: case 0x4: case 0x6: case 0x7: 
+            ++uses[op.x]; 
+            break;
+        case 0x5: case 0x9: 
+            ++uses[op.x]; ++uses[op.y]; 
+            break;
+        case 0x8: 
+            ++uses[op.x]; ++uses[op.y]; ++uses[0xF]; 
+            break;
+        case 0xF: 
+            ++uses[op.x]; 
+            break;
+        }
+    }
+
+    BlockFn compile(uint16_t pc, const Op* block, unsigned length) {
+        if (code_used + MAX_BLOCK_CODE > CODE_SIZE) {
+            // Out of room: throw away everything compiled so far
+            code_used = 0;
+            std::fill(native.begin(), native.end(), NativeBlock{});
+        }
+        BlockCompiler c;
+
+        // Keep registers used more than once natively in host registers
+        std::array<unsigned, 16> uses = {0};
+        for (unsigned i = 0; i < length; ++i) {
+            BlockCompiler probe;
+            if (compile_op(probe, block[i], pc + i * 2)) count_uses(block[i], uses);
+        }
+        std::array<uint8_t, 16> order;
+        for (uint8_t v = 0; v < 16; ++v) order[v] = v;
+        std::stable_sort(order.begin(), order.end(), 
+            [&](uint8_t a, uint8_t b) { return uses[a] > uses[b]; });
+        for (unsigned i = 0; i < HOST_REGS.size() && uses[order[i]] > 1; ++i) {
+            c.host[order[i]] = HOST_REGS[i];
+        }
+
+        // Ops handled by the interpreter are copied in front of the code,
+        // so that their handlers have a stable Op to read from.
+        std::vector<const Op*> fallbacks;
+        std::vector<uint8_t>   fallback_at(length, 0);
+        for (unsigned i = 0; i < length; ++i) {
+            BlockCompiler probe;
+            if (!compile_op(probe, block[i], pc + i * 2)) {
+                fallback_at[i] = 1;
+                fallbacks.push_back(&block[i]);
+            }
+        }
+        size_t   data_start = (code_used + 15) & ~size_t(15);
+        uint8_t* data       = code + data_start;
+        uint8_t* entry      = data + fallbacks.size() * sizeof(Op);
+
+        // Prologue: save callee-saved registers, keeping the stack 16 byte aligned
+        Emitter& e = c.e;
+        for (auto reg = SAVED_REGS.begin(); reg != SAVED_REGS.end(); ++reg) {
+            e.push(*reg);
+        }
+        e.byte(0x48); e.byte(0x83); e.byte(0xEC); e.byte(0x08); // sub rsp, 8
+        e.byte(0x48); e.byte(0x89); e.byte(0xFB);               // mov rbx, rdi
+        c.reload_all();
+
+        for (unsigned i = 0, f = 0; i < length; ++i) {
+            uint16_t op_pc = pc + i * 2;
+            if (!fallback_at[i]) {
+                compile_op(c, block[i], op_pc);
+                continue;
+            }
+            // Hand the op to the interpreter as if it had just been fetched
+            c.write_back();
+            e.mov_m16_imm16(PC_OFFSET, op_pc + 2);
+            e.byte(0x48); e.byte(0x89); e.byte(0xDF); // mov rdi, rbx
+            e.mov_r64_imm64(6, reinterpret_cast<uint64_t>(data + f++ * sizeof(Op)));
+            e.mov_r64_imm64(RAX, reinterpret_cast<uint64_t>(block[i].exec));
+            e.byte(0xFF); e.byte(0xD0);               // call rax
+            c.reload_all();
+        }
+        // Jumps and the interpreter's handlers have already set PC
+        if (!fallback_at[length - 1] && !ends_with_jump(block[length - 1])) {
+            e.mov_m16_imm16(PC_OFFSET, pc + length * 2);
+        }
+
+        // Epilogue
+        c.write_back();
+        e.byte(0x48); e.byte(0x83); e.byte(0xC4); e.byte(0x08); // add rsp, 8
+        for (auto reg = SAVED_REGS.rbegin(); reg != SAVED_REGS.rend(); ++reg) {
+            e.pop(*reg);
+        }
+        e.byte(0xC3); // ret
+
+        // Copy everything in, keeping the buffer either writable or executable
+        mprotect(code, CODE_SIZE, PROT_READ | PROT_WRITE);
+        for (size_t i = 0; i < fallbacks.size(); ++i) {
+            std::memcpy(data + i * sizeof(Op), fallbacks[i], sizeof(Op));
+        }
+        std::memcpy(entry, e.bytes.data(), e.bytes.size());
+        mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+        code_used = entry - code + e.bytes.size();
+
+        return reinterpret_cast<BlockFn>(entry);
+    }
+
+    // Natively compiled ops which set PC themselves
+    static bool ends_with_jump(const Op& op) {
+        switch (op.opcode >> 12) {
+        case 0x1: case 0xB: case 0x3: case 0x4: case 0x5: case 0x9:
+            return true;
+        }
+        return false;
+    }
+};
+#endif
+
+
+
+#include <cstring>
+#include <deque>
+
+// A history of states for rewinding. Each frame is stored as the XOR of
+// the state before it with the state after it, run-length encoded, so
+// that the unchanged majority of memory costs next to nothing. Frames
+// are kept newest-last in a fixed size ring of bytes, and the oldest
+// are dropped to make room.
+class RewindBuffer {
+    using State = Chip8Cpu::State;
+    static constexpr size_t STATE_SIZE = sizeof(State);
+    // Runs of unchanged bytes shorter than this are folded into literals
+    static constexpr size_t MIN_RUN = 4;
+
+    std::vector<uint8_t> ring;
+    size_t head = 0;
+    size_t used = 0;
+    // Start and size of each frame in the ring, oldest first
+    std::deque<std::pair<size_t, size_t>> frames;
+
+    State latest;
+    bool  has_latest = false;
+    std::vector<uint8_t> scratch;
+
+public:
+    explicit RewindBuffer(size_t capacity) : ring(capacity) {}
+
+    // Record the state for the current frame
+    void push(const State& state) {
+        // An empty ring means rewinding is turned off
+        if (ring.empty()) {
+            return;
+        }
+        if (has_latest) {
+            encode(latest, state, scratch);
+            store(scratch);
+        }
+        latest     = state;
+        has_latest = true;
+    }
+
+    // Step back a frame, returning false when there is no more history
+    bool pop(State& state) {
+        if (frames.empty()) {
+            return false;
+        }
+        auto [start, size] = frames.back();
+        frames.pop_back();
+        head  = start;
+        used -= size;
+
+        scratch.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            scratch[i] = ring[(start + i) % ring.size()];
+        }
+        decode(scratch, latest);
+        state = latest;
+        return true;
+    }
+
+    size_t frame_count() const {
+        return frames.size();
+    }
+
+    size_t bytes_used() const {
+        return used;
+    }
+
+private:
+    static const uint8_t* bytes(const State& state) {
+        return reinterpret_cast<const uint8_t*>(&state);
+    }
+
+    // Encoded as pairs of 16 bit lengths, the first counting unchanged
+    // bytes to skip and the second the XORed bytes which follow
+    static void encode(const State& prev, const State& next, std::vector<uint8_t>& out) {
+        const uint8_t* a = bytes(prev);
+        const uint8_t* b = bytes(next);
+        auto put16 = [&](size_t v) { 
+            out.push_back(v & 0xFF); 
+            out.push_back(v >> 8); 
+        };
+        auto run_at = [&](size_t i) {
+            size_t run = 0;
+            while (i + run < STATE_SIZE && a[i + run] == b[i + run]) ++run;
+            return run;
+        };
+
+        out.clear();
+        for (size_t i = 0; i < STATE_SIZE;) {
+            size_t skip = run_at(i);
+            i += skip;
+            if (i == STATE_SIZE) {
+                break;
+            }
+            // Take changed bytes up to the next long run of unchanged ones
+            size_t start = i;
+            while (i < STATE_SIZE) {
+                size_t run = run_at(i);
+                if (run >= MIN_RUN || i + run == STATE_SIZE) break;
+                i += run + 1;
+            }
+            put16(skip);
+            put16(i - start);
+            for (size_t j = start; j < i; ++j) {
+                out.push_back(a[j] ^ b[j]);
+            }
+        }
+    }
+
+    static void decode(const std::vector<uint8_t>& in, State& state) {
+        uint8_t* s = reinterpret_cast<uint8_t*>(&state);
+        size_t   i = 0;
+        for (size_t pos = 0; pos + 4 <= in.size();) {
+            i += in[pos] | in[pos + 1] << 8;
+            size_t length = in[pos + 2] | in[pos + 3] << 8;
+            pos += 4;
+            for (size_t j = 0; j < length; ++j) {
+                s[i++] ^= in[pos++];
+            }
+        }
+    }
+
+    void store(const std::vector<uint8_t>& frame) {
+        // Nothing changed, so stepping back over this frame would do
+        // nothing, and an empty frame would never be evicted
+        if (frame.empty()) {
+            return;
+        }
+        if (frame.size() > ring.size()) {
+            // Can't be held at all, so the history is broken
+            frames.clear();
+            used = 0;
+            return;
+        }
+        while (used + frame.size() > ring.size()) {
+            used -= frames.front().second;
+            frames.pop_front();
+        }
+        for (size_t i = 0; i < frame.size(); ++i) {
+            ring[(head + i) % ring.size()] = frame[i];
+        }
+        frames.emplace_back(head, frame.size());
+        head  = (head + frame.size()) % ring.size();
+        used += frame.size();
+    }
+};
+
+
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+constexpr int TIMER_HZ = 60;
+
+// How many of hz instructions a second run in a given 60 Hz tick,
+// spreading the remainder so that exactly hz run each second
+static uint64_t tick_share(int64_t tick, uint64_t hz) {
+    int64_t tick_in_second = tick % TIMER_HZ;
+    return (tick_in_second + 1) * hz / TIMER_HZ - tick_in_second * hz / TIMER_HZ;
+}
+
+// A key's state changing once the CPU reaches a cycle, whether scripted
+// or recorded
+struct KeyEvent {
+    uint64_t cycle;
+    uint8_t  key;
+    uint8_t  pressed;
+};
+
+// Runs many independent instances of a ROM across a pool of threads.
+// Instances are kept as bare states in one contiguous array, and each
+// worker swaps them in and out of its own Chip8Cpu, so an instance
+// costs a little over 4 KiB however large the interpreter's caches are.
+// Work is handed out as ranges of instances, and workers which run out
+// steal the back half of another worker's range.
+class BatchRunner {
+public:
+    struct Result {
+        uint64_t display_hash;
+        uint64_t executed;
+        bool     waiting;
+    };
+
+private:
+    // Instances handed out a few at a time, to keep locking rare
+    static constexpr size_t CHUNK = 8;
+
+    struct alignas(64) WorkRange {
+        std::mutex lock;
+        size_t     begin = 0;
+        size_t     end   = 0;
+    };
+
+    std::vector<Chip8Cpu::State> states;
+    std::vector<Result>          results;
+    // Every instance's key script, one after another. Instance i's
+    // events run from event_start[i] up to event_start[i + 1].
+    std::vector<KeyEvent>        events;
+    std::vector<uint32_t>        event_start = {0};
+
+public:
+    // Returns the index of the new instance. keys must be sorted by cycle.
+    size_t add_instance(const Chip8Cpu::State& state, const std::vector<KeyEvent>& keys) {
+        states.push_back(state);
+        results.push_back(Result{});
+        events.insert(events.end(), keys.begin(), keys.end());
+        event_start.push_back(events.size());
+        return states.size() - 1;
+    }
+
+    size_t size() const {
+        return states.size();
+    }
+
+    const Chip8Cpu::State& get_state(size_t index) const {
+        return states[index];
+    }
+
+    const Result& get_result(size_t index) const {
+        return results[index];
+    }
+
+    // Advances every instance by the given number of cycles, ticking
+    // their timers after each 60 Hz tick's share of hz instructions.
+    // Returns how many threads it ran on, which is at least one.
+    unsigned run(uint64_t cycles, uint64_t hz, unsigned threads, bool use_jit) {
+        threads = std::max(1u, threads);
+        std::vector<WorkRange> ranges(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            ranges[t].begin = size() *  t      / threads;
+            ranges[t].end   = size() * (t + 1) / threads;
+        }
+
+        auto worker = [&](unsigned self) {
+            Chip8Cpu cpu;
+#ifdef CHIP8_JIT
+            std::unique_ptr<Chip8Jit> jit;
+            if (use_jit) jit = std::make_unique<Chip8Jit>(cpu);
+#endif
+            auto run_ops = [&](unsigned ops) {
+#ifdef CHIP8_JIT
+                if (jit) return jit->run(ops);
+#endif
+                return cpu.run(ops);
+            };
+            for (size_t begin, end; take_work(ranges, self, begin, end);) {
+                for (size_t i = begin; i < end; ++i) {
+                    run_instance(cpu, run_ops, i, cycles, hz);
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back(worker, t);
+        }
+        worker(0);
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        return threads;
+    }
+
+private:
+    static bool take_work(std::vector<WorkRange>& ranges, unsigned self, 
+                          size_t& begin, size_t& end) {
+        WorkRange& own = ranges[self];
+        {
+            std::lock_guard guard(own.lock);
+            if (own.begin < own.end) {
+                begin = own.begin;
+                end   = own.begin = std::min(own.end, own.begin + CHUNK);
+                return true;
+            }
+        }
+        // Only one lock is held at a time, so thieves can't deadlock
+        for (unsigned k = 1; k < ranges.size(); ++k) {
+            WorkRange& victim = ranges[(self + k) % ranges.size()];
+            size_t stolen_begin, stolen_end;
+            {
+                std::lock_guard guard(victim.lock);
+                if (victim.begin == victim.end) continue;
+                stolen_end   = victim.end;
+                stolen_begin = victim.end = victim.end - (victim.end - victim.begin + 1) / 2;
+            }
+            std::lock_guard guard(own.lock);
+            begin = stolen_begin;
+            end   = own.begin = std::min(stolen_end, stolen_begin + CHUNK);
+            own.end = stolen_end;
+            return true;
+        }
+        return false;
+    }
+
+    void run_instance(Chip8Cpu& cpu, auto&& run_ops, size_t index, 
+                      uint64_t cycles, uint64_t hz) {
+        cpu.load_state(states[index]);
+        size_t   next_event = event_start[index];
+        size_t   last_event = event_start[index + 1];
+        uint64_t cycle      = 0;
+        uint64_t executed   = 0;
+        int64_t  tick       = 0;
+        uint64_t next_frame = tick_share(tick, hz);
+
+        auto advance_to = [&](uint64_t target) {
+            for (; next_frame <= target; next_frame += tick_share(++tick, hz)) {
+                cpu.update_timers();
+            }
+            cycle = target;
+        };
+
+        while (cycle < cycles) {
+            for (; next_event < last_event && events[next_event].cycle <= cycle; ++next_event) {
+                cpu.process_key(events[next_event].key, events[next_event].pressed);
+            }
+            uint64_t until = std::min(cycles, next_frame);
+            if (next_event < last_event) {
+                until = std::min(until, events[next_event].cycle);
+            }
+            unsigned ran = run_ops(until - cycle);
+            executed += ran;
+            advance_to(cycle + ran);
+
+            if (cpu.is_waiting()) {
+                // Nothing runs until the next key, but time still passes
+                if (next_event == last_event) break;
+                advance_to(std::min(cycles, events[next_event].cycle));
+            }
+        }
+
+        states[index]  = cpu.save_state();
+        results[index] = {cpu.hash_display(), executed, cpu.is_waiting()};
+    }
+};
+
+
+
+#include <SDL2/SDL.h>
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A queue between exactly one producer thread and one consumer thread,
+// which never blocks. push fails when the queue is full.
+template<typename T, size_t N>
+class SpscQueue {
+    std::array<T, N> items;
+    alignas(64) std::atomic<size_t> head{0}; // Next to be read
+    alignas(64) std::atomic<size_t> tail{0}; // Next to be written
+
+public:
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[t % N] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h % N];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Hands frames from one thread to another without either waiting. The
+// writer fills its back buffer then swaps it with the middle one, and
+// the reader swaps its front buffer with the middle one whenever the
+// writer has left a new frame there.
+template<typename T>
+class TripleBuffer {
+    // Set alongside the middle buffer's index when it holds a new frame
+    static constexpr uint8_t FRESH = 4;
+
+    std::array<T, 3>     buffers;
+    std::atomic<uint8_t> middle{1};
+    uint8_t back  = 0;
+    uint8_t front = 2;
+
+public:
+    T& back_buffer() {
+        return buffers[back];
+    }
+
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    // The newest frame, or nullptr if it has already been taken
+    const T* take() {
+        if (!(middle.load(std::memory_order_acquire) & FRESH)) {
+            return nullptr;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return &buffers[front];
+    }
+};
+
+// Input passed from the render thread to the emulation thread
+struct InputEvent {
+    enum Type : uint8_t { KEY, SAVE, LOAD } type;
+    uint8_t key     = 0;
+    uint8_t pressed = 0;
+};
+
+// Shared between the render thread and the emulation thread
+struct Controls {
+    std::atomic<bool> running{true};
+    std::atomic<bool> rewinding{false};
+    SpscQueue<InputEvent, 256> input;
+};
+
+using Frame = std::array<uint32_t, 64*32>;
+
+// Returns true if the window needs redrawing
+static bool handle_events(Controls& controls) {
+    std::map<int, uint8_t> key_to_offset = {
+        {SDLK_1, 0x1}, {SDLK_2, 0x2}, {SDLK_3, 0x3}, {SDLK_4, 0xC},
+        {SDLK_q, 0x4}, {SDLK_w, 0x5}, {SDLK_e, 0x6}, {SDLK_r, 0xD},
+        {SDLK_a, 0x7}, {SDLK_s, 0x8}, {SDLK_d, 0x9}, {SDLK_f, 0xE},
+        {SDLK_z, 0xA}, {SDLK_x, 0x0}, {SDLK_c, 0xB}, {SDLK_v, 0xF}
+    };
+    
+    SDL_Event event;
+    bool redraw = false;
+
+    while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            int sym    = event.key.keysym.sym;
+            bool press = event.type == SDL_KEYDOWN;
+
+            if (key_to_offset.find(sym) != key_to_offset.end()) {
+                controls.input.push({InputEvent::KEY, key_to_offset[sym], press});
+            }
+
+            // Backspace rewinds while held, F5 saves and F9 loads
+            if (sym == SDLK_BACKSPACE)   controls.rewinding = press;
+            if (sym == SDLK_F5 && press) controls.input.push({InputEvent::SAVE});
+            if (sym == SDLK_F9 && press) controls.input.push({InputEvent::LOAD});
+
+            if (sym != SDLK_ESCAPE) {
+                break;
+            }
+            [[fallthrough]];
+        }
+        case SDL_QUIT:
+            controls.running = false;
+            break;
+        case SDL_WINDOWEVENT:
+            redraw = true;
+            break;
+        }
+    }
+    return redraw;
+}
+
+// State files are a magic number followed by the raw state
+static constexpr char STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+
+static void save_state_file(const Chip8Cpu& cpu, const std::string& path) {
+    auto state = cpu.save_state();
+    std::ofstream file(path, std::ios::binary);
+    file.write(STATE_MAGIC, sizeof(STATE_MAGIC));
+    file.write(reinterpret_cast<const char*>(&state), sizeof(state));
+    std::cout << (file ? "Saved state to " : "Unable to save state to ") << path << "\n";
+}
+
+static void load_state_file(Chip8Cpu& cpu, const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(STATE_MAGIC)] = {0};
+    Chip8Cpu::State state;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&state), sizeof(state));
+
+    if (!file || !std::equal(magic, magic + sizeof(magic), STATE_MAGIC)) {
+        std::cout << "Unable to load state from " << path << "\n";
+        return;
+    }
+    cpu.load_state(state);
+    std::cout << "Loaded state from " << path << "\n";
+}
+
+// A session's input, and enough else to replay it exactly: the ROM it 
+// ran, the RNG seed, the instruction rate (which decides where the timers
+// tick), and the cycle each key changed on. The file is a header, then a
+// record per key change of the cycles since the last record (as a LEB128
+// varint) and a byte holding the key and whether it was pressed. A last
+// record with END_FLAG set marks where the session stopped, followed by
+// the hash of the state it stopped in to check replays against.
+class InputLog {
+    static constexpr char    MAGIC[4]     = {'C', '8', 'I', 'N'};
+    static constexpr uint8_t PRESSED_FLAG = 0x10;
+    static constexpr uint8_t END_FLAG     = 0x80;
+
+public:
+    uint64_t              rom_hash   = 0;
+    uint64_t              seed       = 0;
+    uint64_t              hz         = 0;
+    std::vector<KeyEvent> events;
+    uint64_t              end_cycle  = 0;
+    uint64_t              final_hash = 0;
+
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        file.write(MAGIC, sizeof(MAGIC));
+        put_word(file, rom_hash);
+        put_word(file, seed);
+        put_word(file, hz);
+
+        uint64_t last = 0;
+        for (auto& event : events) {
+            put_varint(file, event.cycle - last);
+            file.put(event.key | (event.pressed ? PRESSED_FLAG : 0));
+            last = event.cycle;
+        }
+        put_varint(file, end_cycle - last);
+        file.put(END_FLAG);
+        put_word(file, final_hash);
+        return bool(file);
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[sizeof(MAGIC)] = {0};
+        file.read(magic, sizeof(magic));
+        if (!std::equal(magic, magic + sizeof(magic), MAGIC)) {
+            return false;
+        }
+        rom_hash = get_word(file);
+        seed     = get_word(file);
+        hz       = get_word(file);
+
+        events.clear();
+        for (uint64_t cycle = 0; file;) {
+            cycle += get_varint(file);
+            uint8_t byte = file.get();
+            if (byte & END_FLAG) {
+                end_cycle  = cycle;
+                final_hash = get_word(file);
+                break;
+            }
+            events.push_back({cycle, uint8_t(byte & 0xF), uint8_t((byte & PRESSED_FLAG) != 0)});
+        }
+        return bool(file);
+    }
+
+private:
+    static void put_word(std::ostream& file, uint64_t word) {
+        for (int i = 0; i < 8; ++i) file.put(word >> (8 * i));
+    }
+
+    static uint64_t get_word(std::istream& file) {
+        uint64_t word = 0;
+        for (int i = 0; i < 8; ++i) word |= uint64_t(uint8_t(file.get())) << (8 * i);
+        return word;
+    }
+
+    static void put_varint(std::ostream& file, uint64_t value) {
+        for (; value >= 0x80; value >>= 7) file.put(0x80 | (value & 0x7F));
+        file.put(value);
+    }
+
+    static uint64_t get_varint(std::istream& file) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && file; shift += 7) {
+            uint8_t byte = file.get();
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        return value;
+    }
+};
+
+// Runs the CPU in real time until told to stop, meant for its own thread.
+// Each 60 Hz tick runs that tick's share of hz instructions, ticks the 
+// timers and passes the display on if it changed. Ticks are scheduled 
+// against absolute deadlines so that oversleeping never accumulates into
+// drift. Input is only applied between ticks, so when recording, stamping
+// it with the cycle the tick starts on is enough to replay it exactly.
+static void emulate(Chip8Cpu& cpu, auto&& run_ops, Controls& controls, 
+                    TripleBuffer<Frame>& frames, RewindBuffer& rewind,
+                    const std::string& state_path, unsigned long hz,
+                    InputLog* recording) {
+    using clock = std::chrono::steady_clock;
+    // Beyond this many ticks behind, give up catching up
+    constexpr int MAX_LAG  = 6;
+    const auto tick_period = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(1.0 / TIMER_HZ));
+
+    // Kept between ticks so that only changed rows are converted
+    Frame pixels;
+    auto  start = clock::now();
+    // Cycles scheduled so far, whether or not they ran (while waiting on a key)
+    uint64_t cycle = 0;
+
+    for (int64_t tick = 0; controls.running; ++tick) {
+        for (InputEvent event; controls.input.pop(event);) {
+            switch (event.type) {
+            case InputEvent::KEY:
+                cpu.process_key(event.key, event.pressed);
+                if (recording) recording->events.push_back({cycle, event.key, event.pressed});
+                break;
+            case InputEvent::SAVE: 
+                save_state_file(cpu, state_path);
+                break;
+            case InputEvent::LOAD:
+                // Jumping to another state can't be replayed from input alone
+                if (!recording) load_state_file(cpu, state_path);
+                break;
+            }
+        }
+
+        // Either step back through the history or add to it
+        if (controls.rewinding && !recording) {
+            Chip8Cpu::State state;
+            if (rewind.pop(state)) cpu.load_state(state);
+        } else {
+            uint64_t share = tick_share(tick, hz);
+            run_ops(share);
+            cycle += share;
+            cpu.update_timers();
+            rewind.push(cpu.save_state());
+        }
+
+        if (cpu.update_display_buffer(pixels)) {
+            frames.back_buffer() = pixels;
+            frames.publish();
+        }
+
+        auto deadline = start + (tick + 1) * tick_period;
+        if (clock::now() - deadline > MAX_LAG * tick_period) {
+            // Too far behind (a stall, or the machine can't keep up), so
+            // carry on from now rather than running a burst of ticks
+            start = clock::now() - (tick + 1) * tick_period;
+            continue;
+        }
+        std::this_thread::sleep_until(deadline);
+    }
+
+    if (recording) {
+        recording->end_cycle  = cycle;
+        recording->final_hash = cpu.hash_state();
+    }
+}
+
+struct Options {
+    const char*   rom_path     = nullptr;
+    bool          use_jit      = false;
+    bool          check_jit    = false;
+    bool          headless     = false;
+    bool          count_ops    = false;
+    bool          dump_display = false;
+    unsigned long cycles       = 10'000'000;
+    long          until_pc     = -1;
+    unsigned long rewind_mb    = 8;
+    unsigned long hz           = 6000;
+    unsigned long batch        = 0;
+    unsigned long threads      = std::thread::hardware_concurrency();
+    unsigned long seed         = 0;
+    const char*   record_path  = nullptr;
+    const char*   replay_path  = nullptr;
+    const char*   folded_path  = nullptr;
+};
+
+static bool parse_options(int argc, const char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // Options taking a value, which may be given in hex
+        auto value = [&]() {
+            if (i + 1 == argc) {
+                throw std::invalid_argument(arg + " needs a value");
+            }
+            return std::stoul(argv[++i], nullptr, 0);
+        };
+        auto path = [&]() {
+            if (i + 1 == argc) {
+                throw std::invalid_argument(arg + " needs a path");
+            }
+            return argv[++i];
+        };
+        if      (arg == "--jit")          opts.use_jit = true;
+        else if (arg == "--jit-check")    opts.use_jit = opts.check_jit = true;
+        else if (arg == "--headless")     opts.headless = true;
+        else if (arg == "--counts")       opts.count_ops = true;
+        else if (arg == "--dump-display") opts.dump_display = true;
+        else if (arg == "--cycles")       opts.cycles = value();
+        else if (arg == "--until-pc")     opts.until_pc = value() & 0xFFFF;
+        else if (arg == "--rewind-mb")    opts.rewind_mb = value();
+        else if (arg == "--hz")           opts.hz = value();
+        else if (arg == "--batch")        opts.batch = value();
+        else if (arg == "--threads")      opts.threads = value();
+        else if (arg == "--seed")         opts.seed = value();
+        else if (arg == "--record")       opts.record_path = path();
+        else if (arg == "--replay")       opts.replay_path = path();
+        else if (arg == "--folded")       opts.folded_path = path();
+        else if (arg.starts_with("--"))   throw std::invalid_argument("Unknown option " + arg);
+        else                              opts.rom_path = argv[i];
+    }
+    // Time is counted in instructions run, so it can't pass without any
+    if (opts.hz == 0) {
+        throw std::invalid_argument("--hz must be at least 1");
+    }
+    // Instructions are two bytes, so an odd address would never be reached
+    if (opts.until_pc >= 0 && opts.until_pc % 2) {
+        throw std::invalid_argument("--until-pc must be an even address");
+    }
+    return opts.rom_path != nullptr;
+}
+
+// Prints the opcode counts totalled by instruction, most run first
+static void print_opcode_counts(const Chip8Cpu& cpu) {
+    std::map<std::string, uint64_t> by_name;
+    uint64_t total  = 0;
+    auto&    counts = cpu.get_opcode_counts();
+    for (unsigned opcode = 0; opcode < counts.size(); ++opcode) {
+        if (counts[opcode]) by_name[Chip8Cpu::mnemonic(opcode)] += counts[opcode];
+        total += counts[opcode];
+    }
+    std::vector<std::pair<std::string, uint64_t>> sorted(by_name.begin(), by_name.end());
+    std::sort(sorted.begin(), sorted.end(), 
+        [](auto& a, auto& b) { return a.second > b.second; });
+
+    std::cout << "Instruction counts:\n";
+    for (auto& [name, count] : sorted) {
+        std::cout << "  " << std::left << std::setw(20) << name 
+                  << std::right << std::setw(14) << count 
+                  << std::fixed << std::setprecision(2) << std::setw(8) 
+                  << 100.0 * count / std::max<uint64_t>(1, total) << "%\n"
+                  << std::defaultfloat;
+    }
+}
+
+#ifdef CHIP8_PROFILE
+// Reports what the ROM spent its time on, and if given a path writes its
+// call stacks there in the folded format flamegraph.pl and speedscope 
+// read: a line per stack of its frames joined by ';', then the number of
+// instructions run directly in it.
+static void print_profile(const Chip8Cpu& cpu, const char* folded_path) {
+    constexpr size_t HOTSPOTS = 20;
+    auto& profile = cpu.get_profile();
+    auto  memory  = cpu.save_state().memory;
+
+    print_opcode_counts(cpu);
+
+    uint64_t total = 0;
+    std::vector<uint16_t> addrs;
+    for (unsigned addr = 0; addr < profile.pc_counts.size(); ++addr) {
+        if (profile.pc_counts[addr]) addrs.push_back(addr);
+        total += profile.pc_counts[addr];
+    }
+    auto hottest = addrs.begin() + std::min(HOTSPOTS, addrs.size());
+    std::partial_sort(addrs.begin(), hottest, addrs.end(), [&](uint16_t a, uint16_t b) {
+        return profile.pc_counts[a] > profile.pc_counts[b];
+    });
+
+    std::cout << "Hottest addresses:\n";
+    for (auto addr = addrs.begin(); addr != hottest; ++addr) {
+        uint16_t opcode = memory[*addr] << 8 | memory[(*addr + 1) & 0xFFF];
+        uint64_t count  = profile.pc_counts[*addr];
+        std::cout << "  0x" << std::hex << std::setfill('0') << std::setw(3) << *addr 
+                  << "  " << std::setw(4) << opcode << std::dec << std::setfill(' ') 
+                  << "  " << std::left << std::setw(20) << Chip8Cpu::mnemonic(opcode)
+                  << std::right << std::setw(14) << count
+                  << std::fixed << std::setprecision(2) << std::setw(8) 
+                  << 100.0 * count / std::max<uint64_t>(1, total) << "%\n"
+                  << std::defaultfloat;
+    }
+
+    std::chrono::duration<double> waited = profile.key_wait_time;
+    std::cout << "Waited on keys " << profile.key_waits << " times, for " 
+              << waited.count() << "s in total\n";
+
+    if (folded_path) {
+        std::ofstream file(folded_path);
+        for (uint32_t stack = 0; stack < profile.stack_counts.size(); ++stack) {
+            if (!profile.stack_counts[stack]) continue;
+            // Frames are written outermost first
+            std::vector<uint16_t> frames;
+            for (uint32_t frame = stack; frame != 0; frame = profile.stack_parent[frame]) {
+                frames.push_back(profile.stack_addr[frame]);
+            }
+            file << "main";
+            for (auto addr = frames.rbegin(); addr != frames.rend(); ++addr) {
+                file << ";sub_" << std::hex << *addr << std::dec;
+            }
+            file << " " << profile.stack_counts[stack] << "\n";
+        }
+        std::cout << (file ? "Wrote call stacks to " : "Unable to write call stacks to ") 
+                  << folded_path << "\n";
+    }
+}
+#endif
+
+// Runs without a window as fast as possible, ticking the timers after
+// each 60 Hz tick's share of --hz instructions, as emulate does, then
+// reports how it went. Stops after
+// the cycle limit, at --until-pc, on a key wait (there are no keys
+// to press), or when the ROM settles into a jump to itself.
+static int run_headless(Chip8Cpu& cpu, auto&& run_ops, const Options& opts) {
+    using clock = std::chrono::steady_clock;
+
+    if (opts.until_pc >= 0) {
+        cpu.set_breakpoint(opts.until_pc);
+    }
+    if (opts.count_ops) {
+        cpu.enable_opcode_counts();
+    }
+
+    unsigned long executed = 0;
+    std::string   stopped  = "cycle limit reached";
+    auto start = clock::now();
+
+    for (int64_t tick = 0; executed < opts.cycles; ++tick) {
+        executed += run_ops(std::min<unsigned long>(tick_share(tick, opts.hz), opts.cycles - executed));
+        cpu.update_timers();
+
+        if (cpu.at_breakpoint()) { stopped = "reached --until-pc"; break; }
+        if (cpu.is_waiting())    { stopped = "waiting on a key";   break; }
+        if (cpu.is_idle())       { stopped = "idle";               break; }
+    }
+    std::chrono::duration<double> elapsed = clock::now() - start;
+
+    std::cout << "Stopped: " << stopped 
+              << " at PC 0x" << std::hex << cpu.get_PC() << std::dec << "\n"
+              << "Ran " << executed << " instructions in " << elapsed.count() << "s ("
+              << executed / elapsed.count() / 1e6 << " million/s)\n";
+
+    if (opts.count_ops) {
+        print_opcode_counts(cpu);
+    }
+
+    if (opts.dump_display) {
+        for (int y = 0; y < 32; ++y) {
+            for (int x = 0; x < 64; ++x) {
+                std::cout << (cpu.get_pixel(x, y) ? '#' : '.');
+            }
+            std::cout << "\n";
+        }
+    }
+
+    // Missing the requested PC counts as a failure, for scripts
+    return opts.until_pc >= 0 && !cpu.at_breakpoint();
+}
+
+// Replays a recorded session as fast as possible, applying each key 
+// change on the cycle it was recorded at and ticking the timers on the
+// same schedule as emulate, then checks it ended in the same state.
+static int run_replay(Chip8Cpu& cpu, auto&& run_ops, const Options& opts, uint64_t rom_hash) {
+    using clock = std::chrono::steady_clock;
+
+    InputLog log;
+    if (!log.load(opts.replay_path)) {
+        std::cout << "Unable to load a recording from " << opts.replay_path << "\n";
+        return 1;
+    }
+    if (log.rom_hash != rom_hash) {
+        std::cout << "The recording was made with a different ROM\n";
+        return 1;
+    }
+    cpu.seed_rng(log.seed);
+
+    uint64_t executed = 0;
+    uint64_t cycle    = 0;
+    size_t   next     = 0;
+    auto start = clock::now();
+
+    for (int64_t tick = 0; cycle < log.end_cycle; ++tick) {
+        for (; next < log.events.size() && log.events[next].cycle <= cycle; ++next) {
+            cpu.process_key(log.events[next].key, log.events[next].pressed);
+        }
+        uint64_t share = tick_share(tick, log.hz);
+        executed += run_ops(share);
+        cycle    += share;
+        cpu.update_timers();
+    }
+    std::chrono::duration<double> elapsed = clock::now() - start;
+
+    bool matches = cpu.hash_state() == log.final_hash;
+    std::cout << "Replayed " << log.events.size() << " key changes over " 
+              << double(log.end_cycle) / log.hz << "s of emulated time\n"
+              << "Ran " << executed << " instructions in " << elapsed.count() << "s ("
+              << executed / elapsed.count() / 1e6 << " million/s)\n"
+              << (matches ? "Final state matches the recording\n" 
+                          : "Final state DIFFERS from the recording\n");
+    return !matches;
+}
+
+// Runs --batch copies of the ROM for --cycles each, every one with its
+// own RNG seed and a random key script, and reports how many distinct
+// screens they finished on.
+static int run_batch(const Chip8Cpu& cpu, const Options& opts) {
+    BatchRunner batch;
+    for (unsigned long i = 0; i < opts.batch; ++i) {
+        SplitMix64 rng{i};
+        std::vector<KeyEvent> keys;
+        // Tap a random key every so often
+        for (uint64_t cycle = rng() % 5000; cycle < opts.cycles; cycle += 500 + rng() % 5000) {
+            uint8_t key = rng() % 16;
+            keys.push_back({cycle, key, 1});
+            keys.push_back({cycle + 100 + rng() % 2000, key, 0});
+        }
+        std::sort(keys.begin(), keys.end(), 
+            [](auto& a, auto& b) { return a.cycle < b.cycle; });
+
+        Chip8Cpu::State state = cpu.save_state();
+        state.rng = i;
+        batch.add_instance(state, keys);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned threads = batch.run(opts.cycles, opts.hz, opts.threads, opts.use_jit);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t executed = 0;
+    std::map<uint64_t, unsigned long> screens;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        executed += batch.get_result(i).executed;
+        ++screens[batch.get_result(i).display_hash];
+    }
+    std::cout << "Ran " << batch.size() << " instances on " << threads 
+              << " threads in " << elapsed.count() << "s (" 
+              << executed / elapsed.count() / 1e6 << " million instructions/s)\n"
+              << screens.size() << " distinct final screens\n";
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    constexpr int SCREEN_WIDTH  = 640;
+    constexpr int SCREEN_HEIGHT = 320;
+
+    Options opts;
+    try {
+        if (!parse_options(argc, argv, opts)) {
+            std::cout << "A ROM is required\n";
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        return 1;
+    }
+
+    // Set up CPU
+    Chip8Cpu cpu = Chip8Cpu();
+    std::ifstream file(opts.rom_path, std::ios::binary);
+    cpu.load_ROM(
+        file, 
+        [](auto& file){ return file.good(); }, 
+        [](auto& file){ return file.get(); });
+    // Identifies the ROM to recordings, so taken before seeding
+    const uint64_t rom_hash = cpu.hash_state();
+    cpu.seed_rng(opts.seed);
+
+#ifdef CHIP8_JIT
+    std::unique_ptr<Chip8Jit> jit;
+    if (opts.use_jit) {
+        jit = std::make_unique<Chip8Jit>(cpu, opts.check_jit);
+    }
+    auto report_jit = [&]() {
+        if (opts.check_jit) {
+            std::cout << "JIT cross-check: " << jit->get_mismatches() << " mismatching blocks\n";
+        }
+    };
+#else
+    if (opts.use_jit) {
+        std::cout << "The JIT is only available on x86-64, interpreting instead\n";
+    }
+    auto report_jit = [](){};
+#endif
+
+    // Profiling builds report on exit whatever the mode
+#ifdef CHIP8_PROFILE
+    auto report_profile = [&]() { print_profile(cpu, opts.folded_path); };
+#else
+    if (opts.folded_path) {
+        std::cout << "Call stacks are only recorded when built with -DCHIP8_PROFILE\n";
+    }
+    auto report_profile = [](){};
+#endif
+    auto run_ops = [&](unsigned ops) {
+#ifdef CHIP8_JIT
+        if (jit) return jit->run(ops);
+#endif
+        return cpu.run(ops);
+    };
+
+    if (opts.batch) {
+        return run_batch(cpu, opts);
+    }
+
+    if (opts.replay_path) {
+        int status = run_replay(cpu, run_ops, opts, rom_hash);
+        report_jit();
+        report_profile();
+        return status;
+    }
+
+    if (opts.headless) {
+        int status = run_headless(cpu, run_ops, opts);
+        report_jit();
+        report_profile();
+        return status;
+    }
+
+    // Set up graphics
+    SDL_Window* window = SDL_CreateWindow(
+        "Chip-8", 
+        SDL_WINDOWPOS_CENTERED, 
+        SDL_WINDOWPOS_CENTERED,
+        SCREEN_WIDTH, SCREEN_HEIGHT, 
+        SDL_WINDOW_RESIZABLE);
+
+    SDL_Renderer* renderer = SDL_CreateRenderer(
+        window, -1, SDL_RENDERER_PRESENTVSYNC);
+
+    SDL_Texture*  texture  = SDL_CreateTexture(
+        renderer, SDL_PIXELFORMAT_ARGB8888, 
+        SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    
+    RewindBuffer rewind(opts.rewind_mb << 20);
+    std::string  state_path = std::string(opts.rom_path) + ".state";
+
+    InputLog recording;
+    recording.rom_hash = rom_hash;
+    recording.seed     = opts.seed;
+    recording.hz       = opts.hz;
+    if (opts.record_path) {
+        std::cout << "Recording input, rewinding and loading states are disabled\n";
+    }
+
+    // Emulation runs on its own thread, leaving this one to
+    // handle events and draw whatever frame is newest
+    Controls            controls;
+    TripleBuffer<Frame> frames;
+    std::thread emulation([&]() {
+        emulate(cpu, run_ops, controls, frames, rewind, state_path, opts.hz, 
+                opts.record_path ? &recording : nullptr);
+    });
+
+    for (bool redraw = true; controls.running;) {
+        redraw |= handle_events(controls);
+
+        if (const Frame* frame = frames.take()) {
+            SDL_UpdateTexture(texture, nullptr, frame->data(), 4*64);
+            redraw = true;
+        }
+        if (redraw) {
+            SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+            SDL_RenderPresent(renderer);
+            redraw = false;
+        } else {
+            SDL_Delay(1);
+        }
+    }
+    emulation.join();
+    SDL_Quit();
+    report_jit();
+    report_profile();
+
+    if (opts.record_path && !recording.save(opts.record_path)) {
+        std::cout << "Unable to save the recording to " << opts.record_path << "\n";
+    }
+}
\ No newline at end of file
@@ -4,12 +4,44 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <regex>
+#include <stdexcept>
+#include <thread>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+#include <atomic>
+#include <new>
+#endif
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-enum class HighlightType
+enum class HighlightType : uint8_t
 {
     HIGHLIGHT_BEGIN,
     NONE,
@@ -88,35 +120,1647 @@ static void apply_rule(const SyntaxRule&           rule,
     }
 }
 
+// Appends text to out a run at a time, starting each run highlighted
+// differently to the one before with its escape code
+struct EscapeWriter
+{
+    std::string&  out;
+    HighlightType current = HighlightType::HIGHLIGHT_BEGIN;
+
+    void write(std::string_view text, HighlightType highlight)
+    {
+        if (text.empty())
+            return;
+        if (highlight != current) {
+            out += colour_table[highlight];
+            current = highlight;
+        }
+        out += text;
+    }
+};
+
+// Room for the text and an escape code every few characters,
+// so that output rarely has to grow while being written
+static std::string make_output_buffer(size_t text_size)
+{
+    std::string output;
+    output.reserve(text_size + text_size / 2);
+    return output;
+}
+
 void highlight_buffer(std::string& string_buffer, 
                       const std::vector<SyntaxRule>& rules)
 {
-    unsigned len = string_buffer.size();
-    std::vector<HighlightType> highlight_buffer(len);
-    std::fill(
-        highlight_buffer.begin(), 
-        highlight_buffer.end(), HighlightType::NONE);
+    std::vector<HighlightType> highlight_buffer(
+        string_buffer.size(), HighlightType::NONE);
 
     // Apply each of the rules to the highlight buffer
     for (auto& rule : rules)
         apply_rule(rule, string_buffer, highlight_buffer);
     
-    // Step through the highlight buffer, inserting
-    // escape codes in the string buffer where it changes
-    auto current_hlight = HighlightType::HIGHLIGHT_BEGIN;
-    int added_length = 0;
+    // Write out each run of the same highlight
+    std::string   output = make_output_buffer(string_buffer.size());
+    EscapeWriter  writer{output};
+    std::string_view text = string_buffer;
+
+    for (size_t start = 0, end; start < text.size(); start = end) {
+        end = start + 1;
+        while (end < text.size() && highlight_buffer[end] == highlight_buffer[start])
+            ++end;
+        writer.write(text.substr(start, end - start), highlight_buffer[start]);
+    }
+    string_buffer.swap(output);
+}
+
+// The lexer below picks out the same token classes as cpp_syntax in a
+// single pass, looking at each byte once (bar unterminated strings).
+// It agrees with the rules on ordinary code, but as it knows where 
+// it is, quotes in comments don't start strings, `//` in a string 
+// doesn't hide a later comment, and block comments can span lines.
+
+// All the lexer has to remember from one line to the next,
+// as strings, line comments and preprocessor lines end with it.
+enum class LexState : uint8_t
+{
+    NORMAL,
+    BLOCK_COMMENT
+};
+
+enum CharClass : uint8_t
+{
+    PLAIN,
+    LETTER,  // Including _, which can start words
+    DIGIT,
+    QUOTE,
+    SLASH,
+    HASH,
+    OPERATOR_CHAR
+};
+
+static constexpr auto char_classes = []()
+{
+    std::array<CharClass, 256> table{};
+    for (int c = 'a'; c <= 'z'; ++c) table[c] = LETTER;
+    for (int c = 'A'; c <= 'Z'; ++c) table[c] = LETTER;
+    for (int c = '0'; c <= '9'; ++c) table[c] = DIGIT;
+    table['_']  = LETTER;
+    table['"']  = QUOTE;
+    table['\''] = QUOTE;
+    table['/']  = SLASH;
+    table['#']  = HASH;
+    for (char c : std::string_view("+-*=?%^<>!~|&")) table[c] = OPERATOR_CHAR;
+    return table;
+}();
+
+struct Word
+{
+    std::string_view text;
+    HighlightType    highlight = HighlightType::NONE;
+};
+
+// A perfect hash table of words, built at compile time, so looking one 
+// up costs one hash and one compare. Each word's hash picks a bucket, 
+// and each bucket has a displacement, found while building, that moves 
+// its words into slots which no other word is using. Finding those a 
+// bucket at a time stays quick however many words there are.
+template<size_t N>
+class WordTable
+{
+    static constexpr size_t SLOTS   = std::bit_ceil(N + N / 4 + 1);
+    static constexpr size_t BUCKETS = N / 4 + 1;
+
+    std::array<Word, SLOTS>       slots{};
+    std::array<uint32_t, BUCKETS> displacements{};
+    size_t                        max_length = 0;
+
+    // FNV-1a, then mixed so that all the bits are usable
+    static constexpr uint64_t hash(std::string_view text)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : text)
+            h = (h ^ (unsigned char) c) * 1099511628211ull;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        return h ^ (h >> 33);
+    }
+
+    static constexpr size_t bucket(uint64_t h)
+    {
+        return uint32_t(h) % BUCKETS;
+    }
+
+    static constexpr size_t slot(uint64_t h, uint32_t displacement)
+    {
+        return (uint32_t(h >> 32) + displacement * (uint32_t(h >> 16) | 1)) % SLOTS;
+    }
+
+public:
+    constexpr WordTable(const std::array<Word, N>& words)
+    {
+        std::array<std::array<uint64_t, N>, BUCKETS> hashes{};
+        std::array<size_t, BUCKETS>                  sizes{};
+        for (auto& word : words) {
+            uint64_t h = hash(word.text);
+            size_t   b = bucket(h);
+            hashes[b][sizes[b]++] = h;
+            max_length = std::max(max_length, word.text.size());
+        }
+
+        // Fill the fullest buckets first, while there's the most room
+        std::array<size_t, BUCKETS> order{};
+        for (size_t b = 0; b < BUCKETS; ++b)
+            order[b] = b;
+        std::sort(order.begin(), order.end(), 
+            [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+        std::array<bool, SLOTS> taken{};
+        for (size_t b : order) {
+            for (uint32_t displacement = 0;; ++displacement) {
+                if (displacement > 100000)
+                    throw "Couldn't place the words, are any repeated?";
+
+                std::array<bool, SLOTS> placed = taken;
+                bool fits = true;
+                for (size_t i = 0; i < sizes[b] && fits; ++i) {
+                    size_t s = slot(hashes[b][i], displacement);
+                    fits = !placed[s];
+                    placed[s] = true;
+                }
+                if (fits) {
+                    taken = placed;
+                    displacements[b] = displacement;
+                    break;
+                }
+            }
+        }
+
+        for (auto& word : words) {
+            uint64_t h = hash(word.text);
+            slots[slot(h, displacements[bucket(h)])] = word;
+        }
+    }
+
+    // The word's highlight, or NONE if it isn't in the table
+    constexpr HighlightType find(std::string_view text) const
+    {
+        if (text.empty() || text.size() > max_length)
+            return HighlightType::NONE;
+        uint64_t h    = hash(text);
+        auto&    word = slots[slot(h, displacements[bucket(h)])];
+        return word.text == text ? word.highlight : HighlightType::NONE;
+    }
+};
+
+static constexpr WordTable cpp_words(std::to_array<Word>({
+    {"if",       HighlightType::KEYWORD},  {"for",      HighlightType::KEYWORD},
+    {"const",    HighlightType::KEYWORD},  {"static",   HighlightType::KEYWORD},
+    {"while",    HighlightType::KEYWORD},  {"do",       HighlightType::KEYWORD},
+    {"switch",   HighlightType::KEYWORD},  {"case",     HighlightType::KEYWORD},
+    {"struct",   HighlightType::KEYWORD},  {"class",    HighlightType::KEYWORD},
+    {"enum",     HighlightType::KEYWORD},
+    {"void",     HighlightType::TYPENAME}, {"char",     HighlightType::TYPENAME},
+    {"unsigned", HighlightType::TYPENAME}, {"int",      HighlightType::TYPENAME},
+    {"float",    HighlightType::TYPENAME}, {"double",   HighlightType::TYPENAME},
+    {"long",     HighlightType::TYPENAME}, {"short",    HighlightType::TYPENAME},
+    {"auto",     HighlightType::TYPENAME}
+}));
+
+static bool is_word_char(std::string_view text, size_t i)
+{
+    if (i >= text.size())
+        return false;
+    auto c = char_classes[(unsigned char) text[i]];
+    return c == LETTER || c == DIGIT;
+}
+
+static size_t line_end(std::string_view text, size_t i)
+{
+    size_t end = text.find('\n', i);
+    return end == std::string_view::npos ? text.size() : end;
+}
+
+// Where the number starting at i ends, or i if there isn't one. Like
+// \d+(\.\d*)*[a-zA-Z]*\b, this is the longest prefix of digits, dotted
+// digits then letters which ends on a word boundary.
+static size_t number_end(std::string_view text, size_t i)
+{
+    size_t end = i;
+    while (end < text.size() && char_classes[(unsigned char) text[end]] == DIGIT)
+        ++end;
+    while (end < text.size() && text[end] == '.') {
+        ++end;
+        while (end < text.size() && char_classes[(unsigned char) text[end]] == DIGIT)
+            ++end;
+    }
+    while (end < text.size() && char_classes[(unsigned char) text[end]] == LETTER && text[end] != '_')
+        ++end;
+
+    for (; end > i; --end) {
+        if (is_word_char(text, end - 1) != is_word_char(text, end))
+            return end;
+    }
+    return i;
+}
+
+// Finds the first of Chars at or after i, or returns text.size(). Most 
+// of a comment or string can be skipped over this way, 16 or 32 bytes 
+// at a time where the CPU allows.
+template<char... Chars>
+static size_t find_first_of(std::string_view text, size_t i)
+{
+    const char* data = text.data();
+#if defined(__AVX2__)
+    for (; i + 32 <= text.size(); i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i found = _mm256_setzero_si256();
+        ((found = _mm256_or_si256(found, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(Chars)))), ...);
+        if (uint32_t mask = _mm256_movemask_epi8(found))
+            return i + std::countr_zero(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= text.size(); i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i found = _mm_setzero_si128();
+        ((found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm_set1_epi8(Chars)))), ...);
+        if (uint32_t mask = _mm_movemask_epi8(found))
+            return i + std::countr_zero(mask);
+    }
+#endif
+    for (; i < text.size(); ++i) {
+        if (((data[i] == Chars) || ...))
+            return i;
+    }
+    return text.size();
+}
+
+// Where the string opening at i ends, or i if it isn't closed on its line.
+// A backslash escapes whatever follows it, other than a line break.
+static size_t string_end(std::string_view text, size_t i)
+{
+    char quote = text[i];
+    for (size_t end = i + 1;; end += 2) {
+        end = quote == '"' ? find_first_of<'"',  '\\', '\n', '\r'>(text, end)
+                           : find_first_of<'\'', '\\', '\n', '\r'>(text, end);
+        if (end == text.size() || text[end] == '\n' || text[end] == '\r')
+            return i;
+        if (text[end] == quote)
+            return end + 1;
+        // Skip over whatever's escaped
+        if (end + 1 == text.size() || text[end + 1] == '\n' || text[end + 1] == '\r')
+            return i;
+    }
+}
+
+// Where the block comment with its body starting at i ends, just past
+// the "*/", or npos if it doesn't. Slashes are rarer than stars in
+// comments, so those are what to look for.
+static size_t comment_end(std::string_view text, size_t i)
+{
+    for (size_t end = i; (end = find_first_of<'/'>(text, end)) < text.size(); ++end) {
+        if (end > i && text[end - 1] == '*')
+            return end + 1;
+    }
+    return std::string_view::npos;
+}
+
+// Finds the next highlighted token in text at or after i, setting start
+// and highlight for it and moving i just past it. Returns false, leaving
+// i at the end, if there are none left. state says whether i is inside 
+// a block comment and is kept up to date.
+static bool next_token(std::string_view text, size_t& i, LexState& state,
+                       size_t& start, HighlightType& highlight)
+{
+    if (state == LexState::BLOCK_COMMENT) {
+        start     = i;
+        highlight = HighlightType::COMMENT;
+        size_t end = comment_end(text, i);
+        if (end == std::string_view::npos) {
+            i = text.size();
+            return start != i;
+        }
+        state = LexState::NORMAL;
+        i = end;
+        return true;
+    }
+
+    while (i < text.size()) {
+        start = i;
+        switch (char_classes[(unsigned char) text[i]]) {
+        case LETTER:
+            while (is_word_char(text, i))
+                ++i;
+            highlight = cpp_words.find(text.substr(start, i - start));
+            if (highlight != HighlightType::NONE)
+                return true;
+            break;
+        case DIGIT:
+            i = number_end(text, start);
+            if (i != start) {
+                highlight = HighlightType::NUM_LIT;
+                return true;
+            }
+            // Nothing can start in the middle of a word
+            while (is_word_char(text, i))
+                ++i;
+            break;
+        case QUOTE:
+            i = string_end(text, start);
+            if (i != start) {
+                highlight = HighlightType::STRING_LIT;
+                return true;
+            }
+            ++i;
+            break;
+        case SLASH:
+            if (i + 1 < text.size() && text[i + 1] == '/') {
+                i = line_end(text, i);
+                highlight = HighlightType::COMMENT;
+            } else if (i + 1 < text.size() && text[i + 1] == '*') {
+                i = comment_end(text, i + 2);
+                if (i == std::string_view::npos) {
+                    i = text.size();
+                    state = LexState::BLOCK_COMMENT;
+                }
+                highlight = HighlightType::COMMENT;
+            } else {
+                ++i;
+                highlight = HighlightType::OPERATOR;
+            }
+            return true;
+        case HASH:
+            i = line_end(text, i);
+            highlight = HighlightType::OTHER;
+            return true;
+        case OPERATOR_CHAR:
+            ++i;
+            highlight = HighlightType::OPERATOR;
+            return true;
+        case PLAIN:
+            ++i;
+            break;
+        }
+    }
+    return false;
+}
+
+// Lexes text starting in the given state, calling emit(start, length, 
+// highlight) for each highlighted token in order, and returns the state
+// it ends in. Anything not in a token is left as NONE.
+template<typename Emit>
+static LexState lex_cpp(std::string_view text, LexState state, Emit&& emit)
+{
+    size_t i = 0, start;
+    HighlightType highlight;
+    while (next_token(text, i, state, start, highlight))
+        emit(start, i - start, highlight);
+    return state;
+}
+
+// Writes text out highlighted with the tokens that 
+// lex reports to the emit function it's given
+static void write_highlighted(std::string_view text, EscapeWriter& writer, auto&& lex)
+{
+    size_t done = 0;
+
+    // Text between tokens is unhighlighted
+    lex([&](size_t start, size_t length, HighlightType highlight) {
+        writer.write(text.substr(done, start - done), HighlightType::NONE);
+        writer.write(text.substr(start, length), highlight);
+        done = start + length;
+    });
+    writer.write(text.substr(done), HighlightType::NONE);
+}
+
+// Lexes text starting in state and writes it out highlighted,
+// returning the state to carry on to whatever text follows
+static LexState write_highlighted(std::string_view text, LexState state, 
+                                  EscapeWriter& writer)
+{
+    write_highlighted(text, writer, 
+        [&](auto&& emit) { state = lex_cpp(text, state, emit); });
+    return state;
+}
+
+// A highlighted token, as an offset and length into the text it's from.
+// Offsets are 32 bits to keep spans small, which limits text to 4 GiB.
+struct TokenSpan
+{
+    uint32_t      offset;
+    uint32_t      length;
+    HighlightType highlight;
+};
+
+// Lexes text into spans in buffers the caller gives it, any number of
+// tokens at a time, without allocating or copying any of the text
+class SpanLexer
+{
+    std::string_view text;
+    size_t           position = 0;
+    LexState         state;
+
+public:
+    explicit SpanLexer(std::string_view text, LexState state = LexState::NORMAL)
+    : text(text), state(state)
+    {}
+
+    // Fills spans with the next tokens and returns how many there were,
+    // which is only less than spans.size() once the text is finished
+    size_t next(std::span<TokenSpan> spans)
+    {
+        size_t        count = 0, start;
+        HighlightType highlight;
+        while (count < spans.size() && next_token(text, position, state, start, highlight))
+            spans[count++] = {uint32_t(start), uint32_t(position - start), highlight};
+        return count;
+    }
+
+    // The state the text ends in, once it's finished
+    LexState end_state() const
+    {
+        return state;
+    }
+};
+
+// Writes text out highlighted with spans, which follow on from 
+// the ones before them, and moves done past the last of them
+static void write_spans(std::string_view text, std::span<const TokenSpan> spans, 
+                        EscapeWriter& writer, size_t& done)
+{
+    for (auto& span : spans) {
+        writer.write(text.substr(done, span.offset - done), HighlightType::NONE);
+        writer.write(text.substr(span.offset, span.length), span.highlight);
+        done = span.offset + span.length;
+    }
+}
+
+void highlight_buffer(std::string& string_buffer)
+{
+    std::string  output = make_output_buffer(string_buffer.size());
+    EscapeWriter writer{output};
+    SpanLexer    lexer(string_buffer);
+
+    std::array<TokenSpan, 256> spans;
+    size_t done = 0;
+    while (size_t count = lexer.next(spans))
+        write_spans(string_buffer, {spans.data(), count}, writer, done);
+    writer.write(std::string_view(string_buffer).substr(done), HighlightType::NONE);
+    string_buffer.swap(output);
+}
+
+// Highlights in as it arrives, a line at a time, carrying the lexer's 
+// state from one line to the next. Memory use is bounded by the longest
+// line rather than the input, and output is identical to highlighting
+// the whole input at once.
+void highlight_stream(std::istream& in, std::ostream& out)
+{
+    LexState     state = LexState::NORMAL;
+    std::string  line;
+    std::string  output;
+    EscapeWriter writer{output};
+
+    while (std::getline(in, line)) {
+        if (!in.eof())
+            line += '\n';
+
+        output.clear();
+        state = write_highlighted(line, state, writer);
+        out << output;
+
+        // Flush before waiting on more input, so a pipe sees each 
+        // line promptly without paying for a flush on every one
+        if (in.rdbuf()->in_avail() <= 0)
+            out.flush();
+    }
+}
+
+// A run of whole lines of the input, lexed on its own thread
+struct Chunk
+{
+    size_t                 start;
+    size_t                 end;
+    std::vector<TokenSpan> tokens;
+    // Lines that lexing the chunk found to start inside a block comment
+    std::vector<size_t>    comment_lines;
+    LexState               end_state;
+};
+
+// Lexes the lines of text from line up to end starting in state, adding
+// their tokens to tokens, until reaching end or a line start for which
+// stop(line, state) is true. Returns where it stopped.
+template<typename Stop>
+static size_t lex_lines(std::string_view text, size_t line, size_t end, LexState& state, 
+                        std::vector<TokenSpan>& tokens, Stop&& stop)
+{
+    for (; line < end && !stop(line, state);) {
+        size_t next = std::min(line_end(text, line) + 1, end);
+        state = lex_cpp(text.substr(line, next - line), state, 
+            [&](size_t start, size_t length, HighlightType highlight) {
+                tokens.push_back({uint32_t(line + start), uint32_t(length), highlight});
+            });
+        line = next;
+    }
+    return line;
+}
+
+// Runs fn(i) for i from 0 to count, each on its own thread
+static void parallel_for(size_t count, auto&& fn)
+{
+    if (count == 0)
+        return;
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; ++i)
+        threads.emplace_back(fn, i);
+    fn(0);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// Gives the same result as highlight_buffer, lexing and writing out 
+// chunk_count chunks of the buffer on as many threads. Each chunk is
+// lexed as if it starts outside any comment, then in order, chunks 
+// which actually start inside one have lines re-lexed until they start
+// in the same state as the first attempt had, after which it was right.
+void highlight_buffer_parallel(std::string& string_buffer, size_t chunk_count)
+{
+    std::string_view   text = string_buffer;
+    std::vector<Chunk> chunks;
+    for (size_t start = 0; start < text.size();) {
+        size_t end = std::max(start + 1, text.size() * (chunks.size() + 1) / chunk_count);
+        end = std::min(line_end(text, end - 1) + 1, text.size());
+        chunks.push_back({start, end, {}, {}, LexState::NORMAL});
+        start = end;
+    }
+
+    parallel_for(chunks.size(), [&](size_t i) {
+        auto&    chunk = chunks[i];
+        LexState state = LexState::NORMAL;
+        lex_lines(text, chunk.start, chunk.end, state, chunk.tokens, 
+            [&](size_t line, LexState state) {
+                if (state == LexState::BLOCK_COMMENT)
+                    chunk.comment_lines.push_back(line);
+                return false;
+            });
+        chunk.end_state = state;
+    });
+
+    LexState state = LexState::NORMAL;
+    for (auto& chunk : chunks) {
+        if (state == LexState::NORMAL) {
+            state = chunk.end_state;
+            continue;
+        }
+
+        std::vector<TokenSpan> tokens;
+        size_t agreed = lex_lines(text, chunk.start, chunk.end, state, tokens, 
+            [&](size_t line, LexState state) {
+                bool guessed_comment = std::binary_search(
+                    chunk.comment_lines.begin(), chunk.comment_lines.end(), line);
+                return line != chunk.start && guessed_comment == (state == LexState::BLOCK_COMMENT);
+            });
+        if (agreed < chunk.end)
+            state = chunk.end_state;
+
+        auto kept = std::find_if(chunk.tokens.begin(), chunk.tokens.end(), 
+            [&](const TokenSpan& token) { return token.offset >= agreed; });
+        tokens.insert(tokens.end(), kept, chunk.tokens.end());
+        chunk.tokens.swap(tokens);
+    }
+
+    std::vector<std::string> outputs(chunks.size());
+    parallel_for(chunks.size(), [&](size_t i) {
+        auto& chunk = chunks[i];
+        outputs[i]  = make_output_buffer(chunk.end - chunk.start);
+        EscapeWriter writer{outputs[i]};
+
+        // Carry on from however the last chunk ended
+        if (i > 0) {
+            auto& last = chunks[i - 1];
+            bool  ends_in_token = !last.tokens.empty() && 
+                last.tokens.back().offset + last.tokens.back().length == last.end;
+            writer.current = ends_in_token ? last.tokens.back().highlight : HighlightType::NONE;
+        }
+
+        size_t done = chunk.start;
+        write_spans(text, chunk.tokens, writer, done);
+        writer.write(text.substr(done, chunk.end - done), HighlightType::NONE);
+    });
+
+    std::string output;
+    size_t      size = 0;
+    for (auto& part : outputs)
+        size += part.size();
+    output.reserve(size);
+    for (auto& part : outputs)
+        output += part;
+    string_buffer.swap(output);
+}
+
+// Keeps a document along with the tokens and end state of each of its 
+// lines, for editors. An edit lexes the lines it touched again, then any
+// lines after them until one starts in the same state it used to, since
+// from there on nothing can have changed.
+class IncrementalHighlighter
+{
+    struct Line
+    {
+        size_t                 start;
+        std::vector<TokenSpan> tokens; // Relative to the line's start
+        LexState               end_state;
+    };
+
+    std::string       document;
+    // Split after each '\n', so there's always at least one
+    std::vector<Line> lines = {{0, {}, LexState::NORMAL}};
+
+public:
+    // The lines an edit lexed again, and their tokens
+    // relative to the start of the document
+    struct Change
+    {
+        size_t                 first_line;
+        size_t                 end_line;
+        std::vector<TokenSpan> tokens;
+    };
+
+    explicit IncrementalHighlighter(std::string_view text = "")
+    {
+        edit(0, 0, text);
+    }
+
+    // Replaces length bytes at offset with text
+    Change edit(size_t offset, size_t length, std::string_view text)
+    {
+        offset = std::min(offset, document.size());
+        length = std::min(length, document.size() - offset);
+
+        size_t   first     = line_at(offset);
+        size_t   last      = line_at(offset + length);
+        LexState old_state = lines[last].end_state;
+        bool     at_end    = last + 1 == lines.size();
+        size_t   end       = at_end ? document.size() : lines[last + 1].start;
+
+        document.replace(offset, length, text);
+        end += text.size() - length;
+
+        // Split the edited lines up again, with a line after
+        // the last '\n' only when there's no line there already
+        std::vector<Line> edited = {{lines[first].start, {}, LexState::NORMAL}};
+        for (size_t i = lines[first].start; i < end; ++i) {
+            if (document[i] == '\n' && (i + 1 < end || at_end))
+                edited.push_back({i + 1, {}, LexState::NORMAL});
+        }
+        for (size_t i = last + 1; i < lines.size(); ++i)
+            lines[i].start += text.size() - length;
+        lines.erase(lines.begin() + first, lines.begin() + last + 1);
+        lines.insert(lines.begin() + first, edited.begin(), edited.end());
+
+        Change   change{first, first, {}};
+        LexState state = first == 0 ? LexState::NORMAL : lines[first - 1].end_state;
+        for (size_t& i = change.end_line; i < lines.size(); ++i) {
+            if (i >= first + edited.size()) {
+                if (state == old_state)
+                    break;
+                old_state = lines[i].end_state;
+            }
+            state = lex_line(i, state);
+            for (auto& token : lines[i].tokens)
+                change.tokens.push_back({uint32_t(lines[i].start + token.offset), token.length, token.highlight});
+        }
+        return change;
+    }
+
+    std::string_view text() const
+    {
+        return document;
+    }
+
+    size_t line_count() const
+    {
+        return lines.size();
+    }
+
+    size_t line_start(size_t line) const
+    {
+        return lines[line].start;
+    }
+
+    const std::vector<TokenSpan>& line_tokens(size_t line) const
+    {
+        return lines[line].tokens;
+    }
+
+private:
+    // The line offset is on, or the last if it's past the end
+    size_t line_at(size_t offset) const
+    {
+        auto after = std::upper_bound(lines.begin(), lines.end(), offset, 
+            [](size_t offset, const Line& line) { return offset < line.start; });
+        return after - lines.begin() - 1;
+    }
+
+    LexState lex_line(size_t i, LexState state)
+    {
+        auto&  line = lines[i];
+        size_t end  = i + 1 < lines.size() ? lines[i + 1].start : document.size();
+
+        line.tokens.clear();
+        line.end_state = lex_cpp(
+            std::string_view(document).substr(line.start, end - line.start), state, 
+            [&](size_t start, size_t length, HighlightType highlight) {
+                line.tokens.push_back({uint32_t(start), uint32_t(length), highlight});
+            });
+        return line.end_state;
+    }
+};
+
+// Languages can also be loaded at runtime from definitions like this 
+// one, which highlights exactly as lex_cpp does. Each line is a rule:
+// a highlight then a pattern, which is a regex of literals, escapes, 
+// ., [classes], (groups), |, *, + and ?, optionally ending in \b to 
+// only match up to a word boundary. At each position the first rule
+// which matches wins, taking as much as it can. Matches of word rules 
+// are highlighted by the words lines, and are otherwise left alone.
+static constexpr std::string_view cpp_definition = R"(# C++
+words    keyword  if for const static while do switch case struct class enum
+words    typename void char unsigned int float double long short auto
+string   "([^"\\\n\r]|\\[^\n\r])*"
+string   '([^'\\\n\r]|\\[^\n\r])*'
+comment  //[^\n]*
+comment  /\*([^*]|\*+[^*/])*\*+/
+comment  /\*([^*]|\*+[^*/])*\**
+number   [0-9]+(\.[0-9]*)*[a-zA-Z]*\b
+word     [A-Za-z_][A-Za-z0-9_]*
+other    #[^\n]*
+operator [-+*/=?%^<>!~|&]
+)";
+
+// A Thompson NFA. Each state either moves to next on any of its bytes,
+// or moves to either of its splits without reading anything.
+struct Nfa
+{
+    struct State
+    {
+        std::bitset<256>   bytes;
+        int                next  = -1;
+        std::array<int, 2> split = {-1, -1};
+        int                rule  = -1; // The rule this state accepts
+    };
+
+    std::vector<State> states;
+
+    int add()
+    {
+        states.emplace_back();
+        return states.size() - 1;
+    }
+};
+
+// Parses a pattern into the NFA as a fragment leading
+// from its start state to its end, which has no moves
+class PatternParser
+{
+    Nfa&             nfa;
+    std::string_view pattern;
+    size_t           pos = 0;
+
+public:
+    struct Fragment
+    {
+        int start;
+        int end;
+    };
+
+    PatternParser(Nfa& nfa, std::string_view pattern)
+    : nfa(nfa), pattern(pattern) 
+    {}
+
+    Fragment parse()
+    {
+        Fragment fragment = alternation();
+        if (pos < pattern.size())
+            throw std::invalid_argument("Unmatched )");
+        return fragment;
+    }
+
+private:
+    Fragment alternation()
+    {
+        Fragment fragment = sequence();
+        while (pos < pattern.size() && pattern[pos] == '|') {
+            ++pos;
+            Fragment other = sequence();
+            int start = nfa.add();
+            int end   = nfa.add();
+            nfa.states[start].split         = {fragment.start, other.start};
+            nfa.states[fragment.end].split  = {end, -1};
+            nfa.states[other.end].split     = {end, -1};
+            fragment = {start, end};
+        }
+        return fragment;
+    }
+
+    Fragment sequence()
+    {
+        int      start = nfa.add();
+        Fragment fragment{start, start};
+        while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')') {
+            Fragment next = repetition();
+            nfa.states[fragment.end].split = {next.start, -1};
+            fragment.end = next.end;
+        }
+        return fragment;
+    }
+
+    Fragment repetition()
+    {
+        Fragment fragment = atom();
+        while (pos < pattern.size() && std::strchr("*+?", pattern[pos])) {
+            char op    = pattern[pos++];
+            int  start = nfa.add();
+            int  end   = nfa.add();
+            nfa.states[start].split        = {fragment.start, op == '+' ? -1 : end};
+            nfa.states[fragment.end].split = {op == '?' ? end : fragment.start, 
+                                              op == '?' ? -1  : end};
+            fragment = {start, end};
+        }
+        return fragment;
+    }
+
+    Fragment atom()
+    {
+        char c = pattern[pos++];
+        if (c == '(') {
+            if (pattern.substr(pos, 2) == "?:")
+                pos += 2;
+            Fragment fragment = alternation();
+            if (pos == pattern.size())
+                throw std::invalid_argument("Unmatched (");
+            ++pos;
+            return fragment;
+        }
+        if (std::strchr("*+?", c))
+            throw std::invalid_argument("Nothing to repeat");
+
+        std::bitset<256> bytes;
+        if (c == '[')
+            bytes = char_class();
+        else if (c == '.')
+            bytes.set().reset('\n');
+        else if (c == '\\')
+            bytes = escape();
+        else
+            bytes.set((unsigned char) c);
+
+        int start = nfa.add();
+        int end   = nfa.add();
+        nfa.states[start].bytes = bytes;
+        nfa.states[start].next  = end;
+        return {start, end};
+    }
+
+    // Follows a '['
+    std::bitset<256> char_class()
+    {
+        std::bitset<256> bytes;
+        bool negated = pos < pattern.size() && pattern[pos] == '^';
+        pos += negated;
+
+        // A ']' straight after the '[' is just a ']'
+        for (bool first = true;; first = false) {
+            if (pos == pattern.size())
+                throw std::invalid_argument("Unmatched [");
+            char c = pattern[pos++];
+            if (c == ']' && !first)
+                break;
+            if (c == '\\') {
+                auto escaped = escape();
+                if (escaped.count() > 1) {
+                    bytes |= escaped;
+                    continue;
+                }
+                c = first_byte(escaped);
+            }
+            // A '-' between two characters makes a range
+            if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+                char last = pattern[pos + 1];
+                pos += 2;
+                if (last == '\\')
+                    last = first_byte(escape());
+                for (int b = (unsigned char) c; b <= (unsigned char) last; ++b)
+                    bytes.set(b);
+            } else {
+                bytes.set((unsigned char) c);
+            }
+        }
+        return negated ? ~bytes : bytes;
+    }
+
+    static char first_byte(const std::bitset<256>& bytes)
+    {
+        int b = 0;
+        while (b < 255 && !bytes[b])
+            ++b;
+        return b;
+    }
+
+    // Follows a '\'
+    std::bitset<256> escape()
+    {
+        if (pos == pattern.size())
+            throw std::invalid_argument("Nothing to escape");
+
+        std::bitset<256> bytes;
+        char c = pattern[pos++];
+        switch (c) {
+        case 'd': case 'D':
+            for (int b = '0'; b <= '9'; ++b) bytes.set(b);
+            break;
+        case 'w': case 'W':
+            for (int b = 0; b < 256; ++b) 
+                if (char_classes[b] == LETTER || char_classes[b] == DIGIT) bytes.set(b);
+            break;
+        case 's': case 'S':
+            for (char b : std::string_view(" \t\n\r\f\v")) bytes.set(b);
+            break;
+        case 'b':
+            throw std::invalid_argument("\\b can only end a pattern");
+        case 'n': bytes.set('\n'); break;
+        case 'r': bytes.set('\r'); break;
+        case 't': bytes.set('\t'); break;
+        case 'f': bytes.set('\f'); break;
+        case 'v': bytes.set('\v'); break;
+        case '0': bytes.set(0);    break;
+        default:  bytes.set((unsigned char) c);
+        }
+        // The upper case classes are the opposites of the lower case ones
+        return c == 'D' || c == 'W' || c == 'S' ? ~bytes : bytes;
+    }
+};
+
+// A language loaded from a definition. Its rules are compiled together
+// into one DFA, which finds which rule matches at a position and how far
+// in one scan, so the cost of highlighting stays the same with more rules.
+class Language
+{
+    static constexpr uint16_t NO_RULE    = 0xFFFF;
+    static constexpr uint32_t DEAD       = 0;
+    static constexpr uint32_t START      = 1;
+    static constexpr size_t   MAX_STATES = 1 << 14;
+
+    struct Rule
+    {
+        HighlightType highlight;
+        bool          is_word;
+    };
+
+    std::vector<Rule>                                      rules;
+    std::map<std::string, HighlightType, std::less<>>      words;
+    std::array<uint8_t, 256>                               byte_classes{};
+    size_t                                                 class_count = 0;
+    // Indexed by state then byte class
+    std::vector<uint32_t>                                  transitions;
+    // The first rule each state accepts, whether just reaching it or only
+    // on a word boundary, and the first any state reachable from it does
+    std::vector<uint16_t>                                  accepts;
+    std::vector<uint16_t>                                  boundary_accepts;
+    std::vector<uint16_t>                                  reachable;
+
+public:
+    // Throws std::invalid_argument, naming the line, if the definition is bad
+    explicit Language(std::string_view definition)
+    {
+        static const std::map<std::string_view, HighlightType> highlights = {
+            {"none",     HighlightType::NONE},     {"word",    HighlightType::NONE},
+            {"typename", HighlightType::TYPENAME}, {"keyword", HighlightType::KEYWORD},
+            {"operator", HighlightType::OPERATOR}, {"comment", HighlightType::COMMENT},
+            {"string",   HighlightType::STRING_LIT}, {"number", HighlightType::NUM_LIT},
+            {"other",    HighlightType::OTHER}
+        };
+
+        Nfa               nfa;
+        std::vector<int>  starts;
+        std::vector<bool> needs_boundary;
+        int               line_number = 0;
+
+        for (auto line : split(definition, '\n')) {
+            ++line_number;
+            line = trim(line);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            try {
+                auto name = next_field(line);
+                if (name == "words") {
+                    auto highlight = highlights.find(next_field(line));
+                    if (highlight == highlights.end())
+                        throw std::invalid_argument("Unknown highlight");
+                    while (!line.empty())
+                        words[std::string(next_field(line))] = highlight->second;
+                    continue;
+                }
+
+                auto highlight = highlights.find(name);
+                if (highlight == highlights.end())
+                    throw std::invalid_argument("Unknown highlight");
+                if (line.empty())
+                    throw std::invalid_argument("Missing pattern");
+
+                bool boundary = line.ends_with("\\b") && !line.ends_with("\\\\b");
+                if (boundary)
+                    line.remove_suffix(2);
+                auto fragment = PatternParser(nfa, line).parse();
+                nfa.states[fragment.end].rule = rules.size();
+
+                starts.push_back(fragment.start);
+                needs_boundary.push_back(boundary);
+                rules.push_back({highlight->second, name == "word"});
+            } catch (const std::invalid_argument& e) {
+                throw std::invalid_argument(
+                    "Line " + std::to_string(line_number) + ": " + e.what());
+            }
+        }
+        if (rules.size() >= NO_RULE)
+            throw std::invalid_argument("Too many rules");
+
+        // Start anywhere, matching any of the rules
+        int start = nfa.add();
+        for (int rule_start : starts) {
+            int split = nfa.add();
+            nfa.states[split].split = {nfa.states[start].split[0], rule_start};
+            nfa.states[start].split = {split, -1};
+        }
+        build_dfa(nfa, start, needs_boundary);
+    }
+
+    // Calls emit(start, length, highlight) for each highlighted token in text
+    template<typename Emit>
+    void lex(std::string_view text, Emit&& emit) const
+    {
+        for (size_t i = 0; i < text.size();) {
+            // Run until no rule better than the best so far can match
+            uint32_t state = START;
+            uint16_t best  = NO_RULE;
+            size_t   end   = i;
+            for (size_t j = i; j < text.size() && reachable[state] <= best;) {
+                state = transitions[state * class_count + byte_classes[(unsigned char) text[j++]]];
+                if (state == DEAD)
+                    break;
+                uint16_t rule = accepts[state];
+                if (is_word_char(text, j - 1) != is_word_char(text, j))
+                    rule = std::min(rule, boundary_accepts[state]);
+                if (rule <= best) {
+                    best = rule;
+                    end  = j;
+                }
+            }
+
+            if (best == NO_RULE) {
+                ++i;
+                continue;
+            }
+            auto highlight = rules[best].highlight;
+            if (rules[best].is_word) {
+                auto word = words.find(text.substr(i, end - i));
+                if (word != words.end())
+                    highlight = word->second;
+            }
+            if (highlight != HighlightType::NONE)
+                emit(i, end - i, highlight);
+            i = end;
+        }
+    }
+
+private:
+    static std::vector<std::string_view> split(std::string_view text, char separator)
+    {
+        std::vector<std::string_view> parts;
+        for (size_t start = 0; start <= text.size();) {
+            size_t end = std::min(text.find(separator, start), text.size());
+            parts.push_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+        return parts;
+    }
+
+    static std::string_view trim(std::string_view text)
+    {
+        while (!text.empty() && std::isspace((unsigned char) text.front()))
+            text.remove_prefix(1);
+        while (!text.empty() && std::isspace((unsigned char) text.back()))
+            text.remove_suffix(1);
+        return text;
+    }
+
+    // Takes the first whitespace separated field off the front of text
+    static std::string_view next_field(std::string_view& text)
+    {
+        size_t end   = std::min(text.find_first_of(" \t"), text.size());
+        auto   field = text.substr(0, end);
+        text = trim(text.substr(end));
+        return field;
+    }
+
+    // Subset construction, over classes of bytes which no state tells apart
+    void build_dfa(const Nfa& nfa, int start, const std::vector<bool>& needs_boundary)
+    {
+        std::map<std::vector<bool>, uint8_t> classes;
+        std::array<int, 256>                 representatives{};
+        for (int b = 0; b < 256; ++b) {
+            std::vector<bool> signature;
+            for (auto& state : nfa.states) {
+                if (state.next >= 0)
+                    signature.push_back(state.bytes[b]);
+            }
+            auto [found, added] = classes.try_emplace(signature, classes.size());
+            byte_classes[b] = found->second;
+            if (added)
+                representatives[found->second] = b;
+        }
+        class_count = classes.size();
+
+        auto closure = [&](std::vector<int> set) {
+            for (size_t i = 0; i < set.size(); ++i) {
+                for (int next : nfa.states[set[i]].split) {
+                    if (next >= 0 && std::find(set.begin(), set.end(), next) == set.end())
+                        set.push_back(next);
+                }
+            }
+            std::sort(set.begin(), set.end());
+            return set;
+        };
+
+        std::map<std::vector<int>, uint32_t> ids;
+        std::vector<std::vector<int>>        sets = {{}, closure({start})};
+        ids[sets[DEAD]]  = DEAD;
+        ids[sets[START]] = START;
+
+        for (uint32_t id = 0; id < sets.size(); ++id) {
+            uint16_t accept = NO_RULE, boundary_accept = NO_RULE;
+            for (int s : sets[id]) {
+                int rule = nfa.states[s].rule;
+                if (rule >= 0 && needs_boundary[rule])
+                    boundary_accept = std::min<uint16_t>(boundary_accept, rule);
+                else if (rule >= 0)
+                    accept = std::min<uint16_t>(accept, rule);
+            }
+            accepts.push_back(accept);
+            boundary_accepts.push_back(boundary_accept);
+
+            for (size_t c = 0; c < class_count; ++c) {
+                std::vector<int> moved;
+                for (int s : sets[id]) {
+                    if (nfa.states[s].next >= 0 && nfa.states[s].bytes[representatives[c]])
+                        moved.push_back(nfa.states[s].next);
+                }
+                auto [found, added] = ids.try_emplace(closure(moved), sets.size());
+                if (added) {
+                    if (sets.size() == MAX_STATES)
+                        throw std::invalid_argument("The rules are too complicated");
+                    sets.push_back(found->first);
+                }
+                transitions.push_back(found->second);
+            }
+        }
+
+        // Spread what each state can go on to accept back to its predecessors
+        reachable.assign(sets.size(), NO_RULE);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t id = 0; id < sets.size(); ++id) {
+                for (size_t c = 0; c < class_count; ++c) {
+                    uint32_t next = transitions[id * class_count + c];
+                    uint16_t best = std::min({reachable[id], reachable[next], 
+                                              accepts[next], boundary_accepts[next]});
+                    changed |= best != reachable[id];
+                    reachable[id] = best;
+                }
+            }
+        }
+    }
+};
+
+void highlight_buffer(std::string& string_buffer, const Language& language)
+{
+    std::string  output = make_output_buffer(string_buffer.size());
+    EscapeWriter writer{output};
+    write_highlighted(string_buffer, writer, 
+        [&](auto&& emit) { language.lex(string_buffer, emit); });
+    string_buffer.swap(output);
+}
+
+// Bump whenever the same rules would highlight differently, 
+// so that spans cached by older versions are never used
+constexpr uint64_t RULES_VERSION = 1;
+
+// A quick 64 bit hash of text for cache keys, a word at a time
+static uint64_t content_hash(std::string_view text, uint64_t hash = 0x9e3779b97f4a7c15)
+{
+    constexpr uint64_t MULTIPLIER = 0xff51afd7ed558ccd;
+
+    size_t i = 0;
+    for (; i + 8 <= text.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + i, 8);
+        hash = std::rotl((hash ^ word) * MULTIPLIER, 29);
+    }
+    for (; i < text.size(); ++i)
+        hash = std::rotl((hash ^ (unsigned char) text[i]) * MULTIPLIER, 29);
+    hash = (hash ^ text.size()) * MULTIPLIER;
+    return hash ^ (hash >> 32);
+}
+
+// A read only file, mapped into memory where that's possible
+class MappedFile
+{
+    const char* data = nullptr;
+    size_t      size = 0;
+#if !defined(__unix__)
+    std::unique_ptr<char[]> copy;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    for (unsigned i = 0; i < len; ++i) {
-        auto& hlight = highlight_buffer[i];
+    ~MappedFile()
+    {
+#if defined(__unix__)
+        if (data)
+            munmap(const_cast<char*>(data), size);
+#endif
+    }
 
-        if (hlight != current_hlight) {
-            auto code = colour_table[hlight];
-            string_buffer.insert(i + added_length, code);
-            // Update added_length to compensate for the inserted escape code
-            added_length += code.size();
-            current_hlight = hlight;
+    bool open(const std::filesystem::path& path)
+    {
+#if defined(__unix__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data = static_cast<const char*>(mapping);
+                size = info.st_size;
+            }
         }
+        close(fd);
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.good())
+            return false;
+        size = file.tellg();
+        copy = std::make_unique<char[]>(size);
+        file.seekg(0);
+        if (file.read(copy.get(), size))
+            data = copy.get();
+#endif
+        return data != nullptr;
+    }
+
+    std::string_view contents() const
+    {
+        return {data, data ? size : 0};
+    }
+};
+
+// Saves the spans a file was highlighted with under a hash of its 
+// contents and the rules used, so that highlighting it again costs 
+// a hash and a map rather than lexing it all
+class SpanCache
+{
+    static constexpr char MAGIC[4] = {'H', 'L', 'S', 'P'};
+
+    // Spans are saved as little endian offsets and lengths followed by
+    // the highlight byte and zeroed padding, which is how TokenSpan is
+    // laid out on little endian machines, so they can be used in place
+    static constexpr size_t SPAN_RECORD_SIZE = 12;
+    static constexpr bool   SPANS_IN_PLACE = std::endian::native == std::endian::little &&
+        sizeof(TokenSpan) == SPAN_RECORD_SIZE && offsetof(TokenSpan, offset) == 0 && 
+        offsetof(TokenSpan, length) == 4 && offsetof(TokenSpan, highlight) == 8;
+
+    // Followed by count spans
+    struct Header
+    {
+        char     magic[4];
+        uint32_t span_size;
+        uint64_t text_hash;
+        uint64_t text_size;
+        uint64_t rules;
+        uint64_t count;
+    };
+
+    std::filesystem::path dir;
+
+    std::filesystem::path path(uint64_t text_hash, uint64_t rules) const
+    {
+        char name[40];
+        std::snprintf(name, sizeof(name), "%016llx-%016llx", 
+            (unsigned long long) text_hash, (unsigned long long) rules);
+        return dir / name;
     }
+
+public:
+    explicit SpanCache(std::filesystem::path dir)
+    : dir(std::move(dir))
+    {}
+
+    // Maps in the spans saved for text, which hashes to text_hash, and
+    // returns them, or nothing if there aren't any or they're invalid
+    std::optional<std::span<const TokenSpan>> find(MappedFile& file, std::string_view text, 
+                                                   uint64_t text_hash, uint64_t rules) const
+    {
+        if (!SPANS_IN_PLACE || !file.open(path(text_hash, rules)))
+            return std::nullopt;
+
+        std::string_view contents = file.contents();
+        Header header;
+        if (contents.size() < sizeof(header))
+            return std::nullopt;
+        std::memcpy(&header, contents.data(), sizeof(header));
+        contents.remove_prefix(sizeof(header));
+
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header.span_size != SPAN_RECORD_SIZE || header.text_hash != text_hash || 
+            header.text_size != text.size() || header.rules != rules ||
+            header.count != contents.size() / SPAN_RECORD_SIZE ||
+            contents.size() % SPAN_RECORD_SIZE != 0)
+            return std::nullopt;
+
+        // Make sure they're in order, in bounds and valid, so a damaged file
+        // can't make the output anything worse than wrongly coloured
+        std::span<const TokenSpan> spans(
+            reinterpret_cast<const TokenSpan*>(contents.data()), header.count);
+        uint64_t done = 0;
+        for (auto& span : spans) {
+            if (span.offset < done || span.offset + uint64_t(span.length) > text.size() ||
+                span.highlight <= HighlightType::HIGHLIGHT_BEGIN || span.highlight > HighlightType::OTHER)
+                return std::nullopt;
+            done = span.offset + span.length;
+        }
+        return spans;
+    }
+
+    // Saves spans for text, writing them to a temporary file first so 
+    // other processes never see half of one. Failing to save is ignored,
+    // since the cache only speeds things up.
+    void store(std::string_view text, uint64_t text_hash, uint64_t rules, 
+               std::span<const TokenSpan> spans) const
+    {
+        if (!SPANS_IN_PLACE)
+            return;
+        std::error_code error;
+        std::filesystem::create_directories(dir, error);
+
+        auto final = path(text_hash, rules);
+        auto temp  = final;
+        temp += ".tmp" + std::to_string(std::random_device{}());
+
+        Header header = {};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.span_size = SPAN_RECORD_SIZE;
+        header.text_hash = text_hash;
+        header.text_size = text.size();
+        header.rules     = rules;
+        header.count     = spans.size();
+
+        // Written a field at a time, so no uninitialised padding is saved
+        std::vector<char> records(spans.size() * SPAN_RECORD_SIZE, 0);
+        for (size_t i = 0; i < spans.size(); ++i) {
+            char* record = records.data() + i * SPAN_RECORD_SIZE;
+            std::memcpy(record, &spans[i].offset, 4);
+            std::memcpy(record + 4, &spans[i].length, 4);
+            record[8] = char(spans[i].highlight);
+        }
+
+        std::ofstream file(temp, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(records.data(), records.size());
+        file.close();
+        if (file.good())
+            std::filesystem::rename(temp, final, error);
+        else
+            std::filesystem::remove(temp, error);
+    }
+};
+
+// Highlights string_buffer with its spans from cache if there are any,
+// and otherwise lexes them with lex(emit) and saves them there
+void highlight_buffer(std::string& string_buffer, const SpanCache& cache, 
+                      uint64_t rules, auto&& lex)
+{
+    std::string_view       text = string_buffer;
+    uint64_t               hash = content_hash(text);
+    MappedFile             file;
+    std::vector<TokenSpan> lexed;
+
+    auto spans = cache.find(file, text, hash, rules);
+    if (!spans) {
+        lex([&](size_t start, size_t length, HighlightType highlight) {
+            lexed.push_back({uint32_t(start), uint32_t(length), highlight});
+        });
+        cache.store(text, hash, rules, lexed);
+        spans = lexed;
+    }
+
+    std::string  output = make_output_buffer(text.size());
+    EscapeWriter writer{output};
+    size_t       done = 0;
+    write_spans(text, *spans, writer, done);
+    writer.write(text.substr(done), HighlightType::NONE);
+    string_buffer.swap(output);
+}
+
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+// Builds counting allocations (-DHLIGHT_COUNT_ALLOCATIONS) replace the
+// global allocator, so --bench can report how many each engine makes.
+// Only allocations made while an engine is timed are counted, so other
+// highlighting on several threads doesn't contend for the count. These
+// aren't inlined, or GCC warns about the free of memory from new.
+static std::atomic<bool>   counting_allocations = false;
+static std::atomic<size_t> allocation_count = 0;
+
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    if (counting_allocations.load(std::memory_order_relaxed))
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+#endif
+
+// Generates about size bytes of made up C++, where around the given 
+// fractions of lines are comments and strings, for benchmarking
+static std::string generate_cpp(size_t size, double comments, double strings, 
+                                bool multiline_comments, uint64_t seed)
+{
+    static constexpr std::array<std::string_view, 8> names = {
+        "count", "buffer", "index", "node", "value", "offset", "parse", "emit"
+    };
+    static constexpr std::array<std::string_view, 8> statements = {
+        "    int $ = 42;\n",
+        "    for (unsigned $ = 0; $ < $; ++$)\n",
+        "    $ = $ * 0x1f + $ % 7;\n",
+        "    if ($ != $ && !$) {\n        return $(1.5f, 'c');\n    }\n",
+        "struct $\n{\n    double $;\n    long $;\n};\n",
+        "#include <vector>\n",
+        "    while ($--) $ |= $ << 2;\n",
+        "    static const char* $ = $ ? $ : $;\n",
+    };
+
+    std::mt19937_64 random(seed);
+    auto chance = [&](double p) { return std::uniform_real_distribution<>(0, 1)(random) < p; };
+    auto name   = [&] { return names[random() % names.size()]; };
+
+    std::string text;
+    while (text.size() < size) {
+        if (chance(comments)) {
+            if (multiline_comments && chance(.5))
+                text += "/* " + std::string(name()) + " does\n * what it says\n */\n";
+            else if (chance(.5))
+                text += "    /* " + std::string(name()) + " */ " + std::string(name()) + "++;\n";
+            else
+                text += "// Keeps " + std::string(name()) + " 'in' \"order\" */\n";
+        } else if (chance(strings / (1 - comments))) {
+            text += "    puts(\"" + std::string(name()) + " is \\\"%d\\\" // not /* a comment\\n\", '\\'');\n";
+        } else {
+            for (char c : statements[random() % statements.size()]) {
+                if (c == '$')
+                    text += name();
+                else
+                    text += c;
+            }
+        }
+    }
+    return text;
+}
+
+// Times highlight on copies of input until it's taken long enough to
+// trust, printing the best rate and, in builds counting them, the
+// allocations of one run. Returns whether the output matched expected,
+// if that's given.
+static bool bench_engine(std::string_view engine, const std::string& input, 
+                         const std::string* expected, int max_runs, auto&& highlight)
+{
+    using Clock = std::chrono::steady_clock;
+
+    double      best = 0;
+    std::string output;
+    auto        start = Clock::now();
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+    size_t      allocations = 0;
+#endif
+    for (int run = 0; run < max_runs && Clock::now() - start < std::chrono::milliseconds(500); ++run) {
+        output = input;
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+        size_t before = allocation_count.load();
+        counting_allocations = true;
+#endif
+        auto   begin  = Clock::now();
+        highlight(output);
+        auto   end    = Clock::now();
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+        counting_allocations = false;
+        allocations = allocation_count.load() - before;
+#endif
+        best = std::max(best, input.size() / std::chrono::duration<double>(end - begin).count());
+    }
+
+    bool        same = !expected || output == *expected;
+    const char* note = !expected ? "  (not compared)" : same ? "" : "  DIFFERENT OUTPUT";
+    std::printf("  %-10.*s %10.1f MB/s", (int) engine.size(), engine.data(), best / 1e6);
+#ifdef HLIGHT_COUNT_ALLOCATIONS
+    std::printf(" %10zu allocations", allocations);
+#endif
+    std::printf("%s\n", note);
+    return same;
+}
+
+// Benchmarks every engine on generated inputs, checking they all give
+// the same output as the lexer. Returns whether they all did.
+static bool run_benchmark(size_t threads)
+{
+    // The regex engine is only run on small inputs, as it's so slow,
+    // and only compared where it's known to agree with the lexer
+    constexpr size_t MAX_REGEX_SIZE = 1 << 20;
+
+    struct Input
+    {
+        const char* name;
+        size_t      size;
+        double      comments;
+        double      strings;
+        bool        multiline_comments;
+    };
+    constexpr std::array<Input, 5> inputs = {{
+        {"code",        64 << 10, .05, .05, false},
+        {"code",         1 << 20, .05, .05, false},
+        {"comments",     1 << 20, .60, .05, true },
+        {"strings",      1 << 20, .05, .60, false},
+        {"code",         8 << 20, .10, .10, true },
+    }};
+
+    auto cache_dir = std::filesystem::temp_directory_path() / 
+        ("hlight-bench-" + std::to_string(std::random_device{}()));
+    SpanCache cache(cache_dir);
+    Language  language(cpp_definition);
+    bool      all_same = true;
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        auto&       input = inputs[i];
+        std::string text  = generate_cpp(input.size, input.comments, input.strings, 
+                                         input.multiline_comments, i);
+        std::printf("%s, %zu KiB, %.0f%% comments, %.0f%% strings\n", 
+            input.name, text.size() >> 10, input.comments * 100, input.strings * 100);
+
+        std::string expected = text;
+        highlight_buffer(expected);
+
+        bool same = bench_engine("lexer", text, &expected, 100, 
+            [](std::string& s) { highlight_buffer(s); });
+        same &= bench_engine("threads", text, &expected, 100, 
+            [&](std::string& s) { highlight_buffer_parallel(s, std::max<size_t>(threads, 2)); });
+        same &= bench_engine("stream", text, &expected, 100, 
+            [](std::string& s) {
+                std::istringstream in(s);
+                std::ostringstream out;
+                highlight_stream(in, out);
+                s = out.str();
+            });
+        same &= bench_engine("language", text, &expected, 100, 
+            [&](std::string& s) { highlight_buffer(s, language); });
+
+        std::string warm = text;
+        highlight_buffer(warm, cache, RULES_VERSION, 
+            [&](auto&& emit) { lex_cpp(text, LexState::NORMAL, emit); });
+        same &= bench_engine("cache hit", text, &expected, 100, 
+            [&](std::string& s) {
+                highlight_buffer(s, cache, RULES_VERSION, 
+                    [&](auto&& emit) { lex_cpp(text, LexState::NORMAL, emit); });
+            });
+
+        if (input.size <= MAX_REGEX_SIZE)
+            same &= bench_engine("regex", text, input.multiline_comments ? nullptr : &expected, 1, 
+                [](std::string& s) { highlight_buffer(s, cpp_syntax); });
+        all_same &= same;
+    }
+
+    std::error_code error;
+    std::filesystem::remove_all(cache_dir, error);
+    return all_same;
 }
 
 static void abort(const char* why)
@@ -127,18 +1771,105 @@ static void abort(const char* why)
 
 int main(int argc, char** argv)
 {
-    if (argc == 1)
-        abort("An input file is required");
+    // Smaller files aren't worth splitting up
+    constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+
+    const char* path       = nullptr;
+    const char* lang_path  = nullptr;
+    const char* cache_dir  = nullptr;
+    bool        use_regex  = false;
+    bool        use_stream = false;
+    bool        use_bench  = false;
+    size_t      threads    = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--regex")
+            use_regex = true;
+        else if (arg == "--stream")
+            use_stream = true;
+        else if (arg == "--bench")
+            use_bench = true;
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--lang" && i + 1 < argc)
+            lang_path = argv[++i];
+        else if (arg == "--cache" && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (arg.starts_with("--"))
+            abort("Unknown option");
+        else
+            path = argv[i];
+    }
 
-    std::ifstream file(argv[1]);
-    if (!file.good())
-        abort("No such file exists");
+    if (use_bench)
+        return run_benchmark(threads) ? 0 : 1;
+
+    std::ios::sync_with_stdio(false);
+
+    // A language definition, or cpp for the built in one
+    std::unique_ptr<Language> language;
+    uint64_t                  rules = RULES_VERSION;
+    if (lang_path) {
+        std::string definition(cpp_definition);
+        if (std::string_view(lang_path) != "cpp") {
+            std::ifstream lang_file(lang_path);
+            if (!lang_file.good())
+                abort("No such language definition exists");
+            definition.assign(
+                (std::istreambuf_iterator<char>(lang_file)),
+                (std::istreambuf_iterator<char>(         )));
+        }
+        rules = content_hash(definition, RULES_VERSION);
+        try {
+            language = std::make_unique<Language>(definition);
+        } catch (const std::invalid_argument& e) {
+            std::cerr << lang_path << ": ";
+            abort(e.what());
+        }
+    }
+
+    // Standard input is always streamed, for use in pipes
+    std::ifstream file;
+    if (path && std::string_view(path) != "-") {
+        file.open(path);
+        if (!file.good())
+            abort("No such file exists");
+    } else {
+        use_stream = true;
+    }
+    std::istream& in = file.is_open() ? file : std::cin;
+
+    // The original regex rules are kept around to compare against,
+    // and they, loaded languages and the cache need the whole input
+    if (use_stream && !use_regex && !language && !cache_dir) {
+        highlight_stream(in, std::cout);
+        std::cout << "\n";
+        return 0;
+    }
 
     std::string contents( 
-        (std::istreambuf_iterator<char>(file)),
-        (std::istreambuf_iterator<char>(    )));
+        (std::istreambuf_iterator<char>(in)),
+        (std::istreambuf_iterator<char>(  )));
 
-    highlight_buffer(contents, cpp_syntax);
+    size_t chunks = std::min(threads, contents.size() / MIN_CHUNK_SIZE);
+    std::string_view text = contents;
+    if (use_regex)
+        highlight_buffer(contents, cpp_syntax);
+    else if (cache_dir && contents.size() <= UINT32_MAX && language)
+        highlight_buffer(contents, SpanCache(cache_dir), rules, 
+            [&](auto&& emit) { language->lex(text, emit); });
+    else if (cache_dir && contents.size() <= UINT32_MAX)
+        highlight_buffer(contents, SpanCache(cache_dir), rules, 
+            [&](auto&& emit) { lex_cpp(text, LexState::NORMAL, emit); });
+    else if (language)
+        highlight_buffer(contents, *language);
+    else if (contents.size() > UINT32_MAX)
+        abort("Files over 4 GiB can only be highlighted with --stream");
+    else if (chunks > 1)
+        highlight_buffer_parallel(contents, chunks);
+    else
+        highlight_buffer(contents);
 
     std::cout << contents << "\n";
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #version 420 core
 layout (location = 0) in vec3 a_pos;
+layout (location = 1) in vec3 a_offset; // Per instance
 
 uniform mat4 projection; 
 uniform mat4 view; 
@@ -7,5 +8,5 @@ uniform mat4 model;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(a_pos, 1.0);
+    gl_Position = projection * view * (model * vec4(a_pos, 1.0) + vec4(a_offset, 0.0));
 }
\ No newline at end of file
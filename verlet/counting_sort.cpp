@@ -0,0 +1,21 @@
+#include "counting_sort.h"
+#include <algorithm>
+
+void counting_sort(std::span<const unsigned> keys, size_t key_count,
+                   std::vector<unsigned>& starts, std::vector<unsigned>& sorted)
+{
+    starts.assign(key_count + 1, 0);
+    sorted.resize(keys.size());
+
+    for (unsigned key : keys)
+        ++starts[key + 1];
+    for (size_t key = 0; key < key_count; ++key)
+        starts[key + 1] += starts[key];
+
+    // Put each index after the others with its key, which leaves each
+    // key's start where the next one's should be, so shift them back
+    for (size_t i = 0; i < keys.size(); ++i)
+        sorted[starts[keys[i]]++] = i;
+    std::copy_backward(starts.begin(), starts.end() - 1, starts.end());
+    starts[0] = 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __COUNTING_SORT_H
+#define __COUNTING_SORT_H
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+// Sorts the indices of keys by their key, each less than key_count, into
+// sorted. starts is filled with where each key's indices begin in sorted,
+// and has one more entry than there are keys, so a key's indices end
+// where the next key's begin.
+void counting_sort(std::span<const unsigned> keys, size_t key_count,
+                   std::vector<unsigned>& starts, std::vector<unsigned>& sorted);
+
+#endif
@@ -9,6 +9,7 @@
 #include <cassert>
 #include <string>
 #include <iostream>
+#include <vector>
 #include "camera.h"
 #include "opengl_objects.h"
 #include "verlet_system.h"
@@ -67,6 +68,13 @@ void render(sf::Shader& shader, unsigned vertex_array, unsigned size)
     glDrawArrays(GL_TRIANGLES, 0, size);
 }
 
+void render_instanced(sf::Shader& shader, unsigned vertex_array, unsigned size, unsigned count)
+{
+    glUseProgram(shader.getNativeHandle());
+    glBindVertexArray(vertex_array);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, size, count);
+}
+
 auto uniform(glm::mat4 matrix)
 {
     return sf::Glsl::Mat4(glm::value_ptr(matrix));
@@ -74,19 +82,14 @@ auto uniform(glm::mat4 matrix)
 
 void cast_interaction_ray(VerletSystem& verlet_system, const Camera& camera)
 {
-    constexpr int NUM_STEPS = 1000;
-    constexpr float STEP_SCALE = 0.1;
+    constexpr float REACH = 100.0;
     
     auto ray = camera.position;
-    for (int step = 0; step < NUM_STEPS; ++step)
-    {
-        ray.x += glm::cos(glm::radians(camera.yaw)) * STEP_SCALE;
-        ray.y += glm::tan(glm::radians(camera.pitch)) * STEP_SCALE;
-        ray.z += glm::sin(glm::radians(camera.yaw)) * STEP_SCALE;
-
-        if (verlet_system.grab_nearby_point(ray.x, ray.y, ray.z))
-            return;
-    }
+    verlet_system.grab_point_on_ray(ray.x, ray.y, ray.z,
+        glm::cos(glm::radians(camera.yaw)),
+        glm::tan(glm::radians(camera.pitch)),
+        glm::sin(glm::radians(camera.yaw)),
+        REACH);
 }
 
 void update_grabbed_point(VerletSystem& verlet_system, const Camera& camera)
@@ -173,6 +176,12 @@ int main()
     point_shader.loadFromFile("basic_vert.glsl", "basic_frag.glsl");
     unsigned point_vbo = make_buffer(&cube, sizeof(cube), GL_ARRAY_BUFFER);
     unsigned point_vao = make_vertex_array(3u); // Position: 3
+
+    // Every point is drawn at once, as an instance of the cube
+    // offset by its position from this buffer
+    std::vector<float> point_positions;
+    unsigned point_instance_vbo = make_buffer(nullptr, 0, GL_ARRAY_BUFFER);
+    add_instance_attribute(1, point_instance_vbo, 3); // Offset: 3
     
     // Generate a checkerboard pattern for the ground
     unsigned texture;
@@ -247,17 +256,20 @@ int main()
         render(ground_shader, ground_vao, 6);
 
         // Draw points
-        point_shader.setUniform("view", uniform(view));
-        point_shader.setUniform("projection", uniform(projection));
+        point_positions.clear();
         verlet_system.draw_points([&](float x, float y, float z)
         {
-            // Translate the model matrix to the point position
-            model = glm::scale(
-                glm::translate(glm::mat4(1.0f), glm::vec3(x, y, z)),
-                glm::vec3(POINT_SCALE));
-            point_shader.setUniform("model", uniform(model));
-            render(point_shader, point_vao, 36);
+            point_positions.insert(point_positions.end(), {x, y, z});
         });
+        glBindBuffer(GL_ARRAY_BUFFER, point_instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, point_positions.size() * sizeof(float), 
+            point_positions.data(), GL_STREAM_DRAW);
+
+        model = glm::scale(glm::mat4(1.0f), glm::vec3(POINT_SCALE));
+        point_shader.setUniform("model", uniform(model));
+        point_shader.setUniform("view", uniform(view));
+        point_shader.setUniform("projection", uniform(projection));
+        render_instanced(point_shader, point_vao, 36, point_positions.size() / 3);
 
         window.display();
 
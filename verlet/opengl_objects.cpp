@@ -8,3 +8,11 @@ unsigned make_buffer(void* data, unsigned size, int type)
     glBufferData(type, size, data, GL_STATIC_DRAW);
     return handle;
 }
+
+void add_instance_attribute(unsigned index, unsigned buffer, unsigned n)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(index, n, GL_FLOAT, false, n * sizeof(float), (void*) 0);
+    glEnableVertexAttribArray(index);
+    glVertexAttribDivisor(index, 1);
+}
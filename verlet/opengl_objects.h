@@ -7,6 +7,10 @@
 
 unsigned make_buffer(void* data, unsigned size, int type);
 
+// Adds an attribute of n floats to the bound vertex array 
+// which is read from buffer once per instance, not per vertex
+void add_instance_attribute(unsigned index, unsigned buffer, unsigned n);
+
 template<typename ...T> // Assumes that only unsigned ints are passed in
 unsigned make_vertex_array(T&&... attrs) 
 {
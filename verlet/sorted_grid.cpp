@@ -0,0 +1,71 @@
+#include "sorted_grid.h"
+#include "counting_sort.h"
+#include <algorithm>
+#include <cmath>
+
+SortedGrid::SortedGrid(float min_cell_size)
+: min_cell_size(min_cell_size), cell_size(min_cell_size), cell_starts(2, 0)
+{
+}
+
+void SortedGrid::build(const float* x, const float* y, const float* z, size_t count)
+{
+    const float* coords[3] = {x, y, z};
+
+    // Fit the grid to all but the furthest out few points along each 
+    // axis, so stray ones can't stretch it, with cells big enough that 
+    // there are at most a few for each point. Coordinates that aren't
+    // finite are left out, and cell_of clamps them into the edge cells.
+    constexpr size_t OUTLIER_FRACTION = 64;
+    const double max_cells = std::max<double>(count * 4, 64);
+    double extents[3] = {};
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        origin[axis] = 0;
+        extents[axis] = 0;
+        scratch.resize(count);
+        auto finite = [](float v) { return std::isfinite(v); };
+        scratch.erase(std::copy_if(coords[axis], coords[axis] + count, scratch.begin(), finite),
+                      scratch.end());
+        if (scratch.empty())
+            continue;
+        size_t outliers = scratch.size() / OUTLIER_FRACTION;
+        auto low = scratch.begin() + outliers;
+        auto high = scratch.end() - 1 - outliers;
+        std::nth_element(scratch.begin(), low, scratch.end());
+        if (high > low)
+            std::nth_element(low + 1, high, scratch.end());
+        origin[axis] = *low;
+        extents[axis] = double(*high) - *low; // Can be too big for a float
+    }
+
+    // Sizes are worked out as doubles, which can't overflow, 
+    // and only converted once there are few enough cells
+    cell_size = min_cell_size;
+    double sizes[3];
+    for (;;)
+    {
+        double cells = 1;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            sizes[axis] = std::floor(extents[axis] / cell_size) + 1;
+            cells *= sizes[axis];
+        }
+        if (cells <= max_cells)
+            break;
+        cell_size *= std::cbrt(cells / max_cells) * 1.01f;
+    }
+    for (int axis = 0; axis < 3; ++axis)
+        dimensions[axis] = int(sizes[axis]);
+
+    size_t cell_count = size_t(dimensions[0]) * dimensions[1] * dimensions[2];
+    point_cells.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t cell = 0;
+        for (int axis = 2; axis >= 0; --axis)
+            cell = cell * dimensions[axis] + cell_of(axis, coords[axis][i]);
+        point_cells[i] = cell;
+    }
+    counting_sort(point_cells, cell_count, cell_starts, cell_points);
+}
@@ -0,0 +1,60 @@
+#ifndef __SORTED_GRID_H
+#define __SORTED_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Points counting sorted by the index of their cell in a grid of cubes
+// over most of them, with the rest clamped into the cells at its edges.
+// The points of a row of cells are contiguous, and rows next to each
+// other are close by, so looking through the cells around each point 
+// in turn mostly touches memory that's already in cache.
+class SortedGrid
+{
+    float min_cell_size;
+    float cell_size;
+    float origin[3] = {};
+    int dimensions[3] = {1, 1, 1};
+    std::vector<unsigned> cell_starts; // One more than there are cells
+    std::vector<unsigned> cell_points;
+    std::vector<unsigned> point_cells;
+    std::vector<float> scratch;
+
+public:
+    // Cells are made larger than min_cell_size if
+    // the grid would otherwise have too many
+    explicit SortedGrid(float min_cell_size);
+
+    void build(const float* x, const float* y, const float* z, size_t count);
+
+    // The cell v is in along the given axis. Clamped before converting,
+    // as points off the grid can be too far for an int. max returns its
+    // first argument unless the second is greater, so NaNs become 0.
+    int cell_of(int axis, float v) const 
+    { 
+        float cell = std::floor((v - origin[axis]) / cell_size);
+        return int(std::min(std::max(0.0f, cell), float(dimensions[axis] - 1)));
+    }
+
+    // Every point, sorted by cell
+    std::span<const unsigned> sorted_points() const { return cell_points; }
+
+    // The range of sorted points in cells x0 to x1 of the row at (y, z)
+    std::pair<size_t, size_t> row(int x0, int x1, int y, int z) const
+    {
+        if (y < 0 || y >= dimensions[1] || z < 0 || z >= dimensions[2])
+            return {0, 0};
+        x0 = std::max(x0, 0);
+        x1 = std::min(x1, dimensions[0] - 1);
+        if (x0 > x1)
+            return {0, 0};
+        size_t row_start = (size_t(z) * dimensions[1] + y) * dimensions[0];
+        return {cell_starts[row_start + x0], cell_starts[row_start + x1 + 1]};
+    }
+};
+
+#endif
@@ -0,0 +1,20 @@
+#include "spatial_hash.h"
+#include "counting_sort.h"
+#include <algorithm>
+#include <bit>
+
+SpatialHash::SpatialHash(float cell_size)
+: cell_size(cell_size), slot_starts(2, 0)
+{
+}
+
+void SpatialHash::build(const float* x, const float* y, const float* z, size_t count)
+{
+    // Twice as many slots as points keeps collisions rare
+    size_t slot_count = std::bit_ceil(std::max<size_t>(count * 2, 1));
+    slot_starts.assign(slot_count + 1, 0); // Sized first, as slot_of masks by it
+    point_slots.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        point_slots[i] = slot_of(cell_of(x[i]), cell_of(y[i]), cell_of(z[i]));
+    counting_sort(point_slots, slot_count, slot_starts, slot_points);
+}
@@ -0,0 +1,53 @@
+#ifndef __SPATIAL_HASH_H
+#define __SPATIAL_HASH_H
+
+#include <cmath>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+// Points sorted into a uniform grid of cubes. Cells are hashed into a
+// table, so the grid is unbounded, and points are counting sorted by
+// their cell's slot so each slot's points are contiguous.
+class SpatialHash
+{
+    float cell_size;
+    std::vector<unsigned> slot_starts; // One more than there are slots
+    std::vector<unsigned> slot_points;
+    std::vector<unsigned> point_slots;
+
+public:
+    explicit SpatialHash(float cell_size);
+
+    void build(const float* x, const float* y, const float* z, size_t count);
+
+    float get_cell_size() const { return cell_size; }
+
+    // Far off points are clamped into cells well inside an int's range,
+    // leaving room to step past them, and NaNs go in the lowest
+    int cell_of(float v) const
+    {
+        constexpr int LIMIT = 1 << 30;
+        float cell = std::floor(v / cell_size);
+        if (!(cell > -LIMIT))
+            return -LIMIT;
+        return cell < LIMIT ? int(cell) : LIMIT;
+    }
+
+    // The points in the given cell, along with any in other
+    // cells which happen to share its slot
+    std::span<const unsigned> points_in(int cx, int cy, int cz) const
+    {
+        unsigned slot = slot_of(cx, cy, cz);
+        return {slot_points.data() + slot_starts[slot], slot_points.data() + slot_starts[slot + 1]};
+    }
+
+private:
+    unsigned slot_of(int cx, int cy, int cz) const
+    {
+        unsigned hash = unsigned(cx) * 73856093u ^ unsigned(cy) * 19349663u ^ unsigned(cz) * 83492791u;
+        return hash & (slot_starts.size() - 2);
+    }
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned count)
+{
+    for (unsigned i = 1; i < count; ++i)
+        threads.emplace_back([this, i] { work(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void ThreadPool::parallel_for(size_t count, const Job& fn)
+{
+    {
+        std::lock_guard lock(mutex);
+        job = &fn;
+        job_size = count;
+        remaining = threads.size();
+        ++generation;
+    }
+    start.notify_all();
+    run_share(0);
+
+    std::unique_lock lock(mutex);
+    done.wait(lock, [&] { return remaining == 0; });
+}
+
+void ThreadPool::work(unsigned index)
+{
+    for (unsigned seen = 0;;)
+    {
+        std::unique_lock lock(mutex);
+        start.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+        lock.unlock();
+
+        run_share(index);
+
+        // A new job can't start until every thread has finished this one
+        lock.lock();
+        if (--remaining == 0)
+            done.notify_one();
+    }
+}
+
+void ThreadPool::run_share(unsigned index)
+{
+    size_t begin = job_size * index / size();
+    size_t end = job_size * (index + 1) / size();
+    if (begin < end)
+        (*job)(begin, end);
+}
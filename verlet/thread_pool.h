@@ -0,0 +1,40 @@
+#ifndef __THREAD_POOL_H
+#define __THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads which are kept waiting between jobs, so that splitting
+// up small pieces of work many times a frame is cheap
+class ThreadPool
+{
+    using Job = std::function<void(size_t, size_t)>;
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start, done;
+    const Job* job = nullptr;
+    size_t job_size = 0;
+    unsigned generation = 0;
+    unsigned remaining = 0;
+    bool stopping = false;
+
+public:
+    explicit ThreadPool(unsigned count);
+    ~ThreadPool();
+
+    unsigned size() const { return threads.size() + 1; }
+
+    // Splits [0, count) into a range for each thread, including the
+    // calling one, and runs fn(begin, end) on each of them
+    void parallel_for(size_t count, const Job& fn);
+
+private:
+    void work(unsigned index);
+    void run_share(unsigned index);
+};
+
+#endif
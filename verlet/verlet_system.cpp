@@ -1,71 +1,199 @@
 #include "verlet_system.h"
+#include <algorithm>
+#include <bit>
 #include <cmath>
-#include <tuple>
+#include <limits>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 constexpr float FLOOR_HEIGHT = 0.11;
+constexpr float GRAB_RADIUS = 0.2;
+constexpr float POINT_RADIUS = 0.05; // Half the width they're drawn at
+
+VerletSystem::VerletSystem(unsigned thread_count)
+: pick_grid(GRAB_RADIUS * 2),
+  collision_grid(POINT_RADIUS * 2),
+  thread_count(thread_count ? thread_count : std::max(1u, std::thread::hardware_concurrency()))
+{
+}
 
 void VerletSystem::add_point(float x, float y, float z, bool fixed)
 {
-    points.push_back(VerletPointMass{
-        x, y, z, x, y, z, fixed});
+    points.x.push_back(x);
+    points.y.push_back(y);
+    points.z.push_back(z);
+    points.px.push_back(x);
+    points.py.push_back(y);
+    points.pz.push_back(z);
+    points.fixed.push_back(fixed ? -1 : 0);
+    pick_grid_valid = false;
 }
 
 void VerletSystem::add_constraint(unsigned index0, unsigned index1)
 {
-    auto p0 = points[index0];
-    auto p1 = points[index1];
-
     // Set the ideal distance to the distance between the given points
-    float dx = p1.x - p0.x;
-    float dy = p1.y - p0.y;
-    float dz = p1.z - p0.z;
+    float dx = points.x[index1] - points.x[index0];
+    float dy = points.y[index1] - points.y[index0];
+    float dz = points.z[index1] - points.z[index0];
     float ideal_length = sqrtf(dx*dx + dy*dy + dz*dz);
 
     constraints.push_back(VerletConstraint{
         index0, index1, ideal_length
     });
+    constraints_coloured = false;
 }
 
 void VerletSystem::update()
 {
     constexpr int ITERATIONS = 5;
+    if (!constraints_coloured)
+        colour_constraints();
     update_point_masses();
     for (int _ = 0; _ < ITERATIONS; ++_)
         update_constraints();
+    if (collisions_enabled)
+        collide_points();
+    pick_grid_valid = false;
+}
+
+void VerletSystem::set_collisions(bool enabled)
+{
+    collisions_enabled = enabled;
 }
 
 void VerletSystem::update_grabbed_point(float x, float y, float z)
 {
     if (grabbed_index != NOT_GRABBED)
     {
-        auto& point = points[grabbed_index];
-        point.x = x;
-        point.y = std::max(y, FLOOR_HEIGHT);
-        point.z = z;
+        points.x[grabbed_index] = x;
+        points.y[grabbed_index] = std::max(y, FLOOR_HEIGHT);
+        points.z[grabbed_index] = z;
+        pick_grid_valid = false;
     }
 }
 
 
 bool VerletSystem::grab_nearby_point(float x, float y, float z)
 {
-    constexpr float MAX_DIST = 0.2;
+    // Cells are twice the radius, so any point near enough
+    // is in the same cell or one next to it
+    const auto& grid = updated_pick_grid();
+    int cx = grid.cell_of(x);
+    int cy = grid.cell_of(y);
+    int cz = grid.cell_of(z);
+
+    // Grab the first point that's near enough
+    int nearby = NOT_GRABBED;
+    for (int ix = cx - 1; ix <= cx + 1; ++ix)
+    for (int iy = cy - 1; iy <= cy + 1; ++iy)
+    for (int iz = cz - 1; iz <= cz + 1; ++iz)
+    {
+        for (unsigned i : grid.points_in(ix, iy, iz))
+        {
+            float dx, dy, dz, distance_squared;
+            dx = x - points.x[i];
+            dy = y - points.y[i];
+            dz = z - points.z[i];
+            distance_squared = dx*dx + dy*dy + dz*dz;
+
+            if (distance_squared < GRAB_RADIUS*GRAB_RADIUS && unsigned(nearby) > i)
+                nearby = i;
+        }
+    }
+    if (nearby == NOT_GRABBED)
+        return false;
+    grabbed_index = nearby;
+    return true;
+}
+
+bool VerletSystem::grab_point_on_ray(float x, float y, float z, 
+                                     float dx, float dy, float dz, float max_t)
+{
+    constexpr float INF = std::numeric_limits<float>::infinity();
+
+    float length = sqrtf(dx*dx + dy*dy + dz*dz);
+    if (length == 0)
+        return false;
+    float direction[3] = {dx / length, dy / length, dz / length};
+    float max_distance = max_t * length;
+
+    // Find where the ray first enters the sphere around each point
+    // in a cell, keeping the earliest, or the first point if tied
+    float best = INF;
+    int hit = NOT_GRABBED;
+    const auto& grid = updated_pick_grid();
+    auto check_cell = [&](int cx, int cy, int cz)
+    {
+        for (unsigned i : grid.points_in(cx, cy, cz))
+        {
+            float ox = points.x[i] - x;
+            float oy = points.y[i] - y;
+            float oz = points.z[i] - z;
+            float along = ox*direction[0] + oy*direction[1] + oz*direction[2];
+            float miss_squared = ox*ox + oy*oy + oz*oz - along*along;
+            if (miss_squared >= GRAB_RADIUS*GRAB_RADIUS)
+                continue;
+
+            float half_chord = sqrtf(GRAB_RADIUS*GRAB_RADIUS - miss_squared);
+            if (along + half_chord < 0)
+                continue; // Behind the ray
+            float t = std::max(along - half_chord, 0.0f);
+            if (t <= max_distance && (t < best || (t == best && unsigned(hit) > i)))
+            {
+                best = t;
+                hit = i;
+            }
+        }
+    };
+
+    // Walk through the cells the ray passes in order. Spheres reach into
+    // the cells next to their point's, so the cells around each are checked,
+    // which after the first means just the slab of 9 beyond the one moved 
+    // into. Nothing after the cell being entered can be hit any sooner.
+    float origin[3] = {x, y, z};
+    int cell[3], step[3];
+    float next_t[3], delta_t[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        cell[axis] = grid.cell_of(origin[axis]);
+        step[axis] = direction[axis] < 0 ? -1 : 1;
+        float boundary = (cell[axis] + (step[axis] > 0)) * grid.get_cell_size();
+        next_t[axis]  = direction[axis] ? (boundary - origin[axis]) / direction[axis] : INF;
+        delta_t[axis] = direction[axis] ? grid.get_cell_size() / std::abs(direction[axis]) : INF;
+    }
+
+    for (int ix = -1; ix <= 1; ++ix)
+    for (int iy = -1; iy <= 1; ++iy)
+    for (int iz = -1; iz <= 1; ++iz)
+        check_cell(cell[0] + ix, cell[1] + iy, cell[2] + iz);
 
-    for (int i = 0; i < points.size(); ++i)
+    for (;;)
     {
-        auto& point = points[i];
-        float dx, dy, dz, distance_squared;
-        dx = x - point.x;
-        dy = y - point.y;
-        dz = z - point.z;
-        distance_squared = dx*dx + dy*dy + dz*dz;
-
-        if (distance_squared < MAX_DIST*MAX_DIST)
+        int axis = std::min_element(next_t, next_t + 3) - next_t;
+        float t = next_t[axis];
+        if (!(t <= max_distance && t <= best))
+            break;
+        cell[axis] += step[axis];
+        next_t[axis] += delta_t[axis];
+
+        int slab[3] = {cell[0], cell[1], cell[2]};
+        slab[axis] += step[axis];
+        int u = (axis + 1) % 3, v = (axis + 2) % 3;
+        for (int iu = -1; iu <= 1; ++iu)
+        for (int iv = -1; iv <= 1; ++iv)
         {
-            grabbed_index = i;
-            return true;
+            int c[3] = {slab[0], slab[1], slab[2]};
+            c[u] += iu;
+            c[v] += iv;
+            check_cell(c[0], c[1], c[2]);
         }
     }
-    return false;
+
+    if (hit == NOT_GRABBED)
+        return false;
+    grabbed_index = hit;
+    return true;
 }
 
 void VerletSystem::ungrab_point() 
@@ -79,48 +207,178 @@ void VerletSystem::update_point_masses()
     constexpr float FRICTION = 0.95;
     constexpr float RESTITUTION = 0.2;  
     constexpr float MAX_VEL = 2.0;
-    for (auto& point : points)
+
+    size_t i = 0;
+#if defined(__AVX2__)
+    // The same as below for 8 points at a time, with the branches
+    // turned into masks and blends
+    const __m256 gravity     = _mm256_set1_ps(GRAVITY);
+    const __m256 friction    = _mm256_set1_ps(FRICTION);
+    const __m256 restitution = _mm256_set1_ps(RESTITUTION);
+    const __m256 max_vel     = _mm256_set1_ps(MAX_VEL);
+    const __m256 min_vel     = _mm256_set1_ps(-MAX_VEL);
+    const __m256 floor       = _mm256_set1_ps(FLOOR_HEIGHT);
+    auto clamp = [&](__m256 v) 
+    { 
+        return _mm256_min_ps(_mm256_max_ps(v, min_vel), max_vel); 
+    };
+
+    for (; i + 8 <= points.size(); i += 8)
     {
-        if (point.fixed)
+        __m256 x  = _mm256_load_ps(&points.x[i]);
+        __m256 y  = _mm256_load_ps(&points.y[i]);
+        __m256 z  = _mm256_load_ps(&points.z[i]);
+        __m256 px = _mm256_load_ps(&points.px[i]);
+        __m256 py = _mm256_load_ps(&points.py[i]);
+        __m256 pz = _mm256_load_ps(&points.pz[i]);
+        __m256 fixed = _mm256_castsi256_ps(
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(&points.fixed[i])));
+
+        // Get velocity
+        __m256 vx = clamp(_mm256_sub_ps(x, px));
+        __m256 vy = clamp(_mm256_sub_ps(_mm256_sub_ps(y, py), gravity));
+        __m256 vz = clamp(_mm256_sub_ps(z, pz));
+
+        // Check for collision with ground
+        __m256 ny = _mm256_add_ps(y, vy);
+        __m256 grounded = _mm256_cmp_ps(ny, floor, _CMP_LE_OQ);
+        __m256 bounce = _mm256_add_ps(floor, _mm256_mul_ps(vy, restitution));
+        __m256 npy = _mm256_blendv_ps(y, bounce, grounded);
+        ny = _mm256_blendv_ps(ny, floor, grounded);
+        vx = _mm256_blendv_ps(vx, _mm256_mul_ps(vx, friction), grounded);
+        vz = _mm256_blendv_ps(vz, _mm256_mul_ps(vz, friction), grounded);
+
+        // Fixed points keep their positions
+        _mm256_store_ps(&points.x[i],  _mm256_blendv_ps(_mm256_add_ps(x, vx), x, fixed));
+        _mm256_store_ps(&points.y[i],  _mm256_blendv_ps(ny, y, fixed));
+        _mm256_store_ps(&points.z[i],  _mm256_blendv_ps(_mm256_add_ps(z, vz), z, fixed));
+        _mm256_store_ps(&points.px[i], _mm256_blendv_ps(x, px, fixed));
+        _mm256_store_ps(&points.py[i], _mm256_blendv_ps(npy, py, fixed));
+        _mm256_store_ps(&points.pz[i], _mm256_blendv_ps(z, pz, fixed));
+    }
+#endif
+
+    for (; i < points.size(); ++i)
+    {
+        if (points.fixed[i])
             continue;
 
+        float& x = points.x[i];
+        float& y = points.y[i];
+        float& z = points.z[i];
+
         // Get velocity
-        float vx = std::clamp(point.x - point.px,           -MAX_VEL, MAX_VEL);
-        float vy = std::clamp(point.y - point.py - GRAVITY, -MAX_VEL, MAX_VEL);
-        float vz = std::clamp(point.z - point.pz,           -MAX_VEL, MAX_VEL);
+        float vx = std::clamp(x - points.px[i],           -MAX_VEL, MAX_VEL);
+        float vy = std::clamp(y - points.py[i] - GRAVITY, -MAX_VEL, MAX_VEL);
+        float vz = std::clamp(z - points.pz[i],           -MAX_VEL, MAX_VEL);
 
         // Update prev pos
-        std::tie(point.px, point.py, point.pz) = std::make_tuple(
-            point.x, point.y, point.z);
+        points.px[i] = x;
+        points.py[i] = y;
+        points.pz[i] = z;
 
-        point.y += vy;
+        y += vy;
         // Check for collision with ground
-        if (point.y <= FLOOR_HEIGHT)
+        if (y <= FLOOR_HEIGHT)
         {
             // Reverse Y and apply friction to X & Z
-            point.y = FLOOR_HEIGHT;
-            point.py = point.y + vy * RESTITUTION;
+            y = FLOOR_HEIGHT;
+            points.py[i] = y + vy * RESTITUTION;
             vx *= FRICTION;
             vz *= FRICTION;
         }
-        point.x += vx;
-        point.z += vz;
+        x += vx;
+        z += vz;
+    }
+}
+
+const SpatialHash& VerletSystem::updated_pick_grid()
+{
+    if (!pick_grid_valid)
+    {
+        pick_grid.build(points.x.data(), points.y.data(), points.z.data(), points.size());
+        pick_grid_valid = true;
+    }
+    return pick_grid;
+}
+
+void VerletSystem::colour_constraints()
+{
+    // Give each constraint the lowest colour that neither of its
+    // points has a constraint of yet, then sort them by colour, 
+    // keeping the order they were added in within each colour
+    std::vector<uint64_t> used_colours(points.size());
+    std::vector<unsigned> colours(constraints.size());
+    colour_ends.assign(SERIAL_COLOUR + 1, 0);
+    for (size_t i = 0; i < constraints.size(); ++i)
+    {
+        auto& constraint = constraints[i];
+        uint64_t used = used_colours[constraint.index0] | used_colours[constraint.index1];
+        unsigned colour = std::countr_one(used);
+        if (colour != SERIAL_COLOUR)
+        {
+            used_colours[constraint.index0] |= uint64_t(1) << colour;
+            used_colours[constraint.index1] |= uint64_t(1) << colour;
+        }
+        colours[i] = colour;
+        ++colour_ends[colour];
     }
+
+    std::vector<size_t> next(SERIAL_COLOUR + 1);
+    for (unsigned colour = 0, start = 0; colour <= SERIAL_COLOUR; ++colour)
+    {
+        next[colour] = start;
+        start += colour_ends[colour];
+        colour_ends[colour] = start;
+    }
+    coloured_constraints.resize(constraints.size());
+    for (size_t i = 0; i < constraints.size(); ++i)
+        coloured_constraints[next[colours[i]]++] = constraints[i];
+    constraints_coloured = true;
 }
 
 void VerletSystem::update_constraints()
 {
-    for (auto& constraint : constraints)
+    // Batches smaller than this aren't worth waking threads for
+    constexpr size_t MIN_PARALLEL_BATCH = 4096;
+
+    // Constraints in a batch can be solved in any order with the same
+    // result, so it doesn't depend on how they're split between threads
+    size_t begin = 0;
+    for (unsigned colour = 0; colour < colour_ends.size(); ++colour)
+    {
+        size_t end = colour_ends[colour];
+        if (colour == SERIAL_COLOUR || thread_count == 1 || end - begin < MIN_PARALLEL_BATCH)
+        {
+            solve_constraints(begin, end);
+        }
+        else
+        {
+            if (!thread_pool)
+                thread_pool = std::make_unique<ThreadPool>(thread_count);
+            thread_pool->parallel_for(end - begin, [&](size_t first, size_t last)
+            {
+                solve_constraints(begin + first, begin + last);
+            });
+        }
+        begin = end;
+    }
+}
+
+void VerletSystem::solve_constraints(size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i)
     {
-        auto& p0 = points[constraint.index0];
-        auto& p1 = points[constraint.index1];
+        auto& constraint = coloured_constraints[i];
+        unsigned i0 = constraint.index0;
+        unsigned i1 = constraint.index1;
 
         // Find the distance that the points must move to
         // maintain the constraint's distance.
         float dx, dy, dz, distance, difference, mult;
-        dx = p1.x - p0.x;
-        dy = p1.y - p0.y;
-        dz = p1.z - p0.z;
+        dx = points.x[i1] - points.x[i0];
+        dy = points.y[i1] - points.y[i0];
+        dz = points.z[i1] - points.z[i0];
         distance = sqrt(dx*dx + dy*dy + dz*dz);
         difference = constraint.ideal_length - distance;
         mult = (difference / distance) * 0.5f;
@@ -130,18 +388,92 @@ void VerletSystem::update_constraints()
         float oz = dz*mult;
         
         // Correct the points
-        if (!p0.fixed)
+        if (!points.fixed[i0])
         {
-            p0.x -= ox;
-            p0.y -= oy;
-            p0.z -= oz;
+            points.x[i0] -= ox;
+            points.y[i0] -= oy;
+            points.z[i0] -= oz;
         }
 
-        if (!p1.fixed)
+        if (!points.fixed[i1])
         {
-            p1.x += ox;
-            p1.y += oy;
-            p1.z += oz;
+            points.x[i1] += ox;
+            points.y[i1] += oy;
+            points.z[i1] += oz;
         }
     }
-}
\ No newline at end of file
+}
+
+void VerletSystem::collide_points()
+{
+    constexpr float DIAMETER = POINT_RADIUS * 2;
+
+    // Cells are at least a diameter wide, so points close enough to collide
+    // are in the same or neighbouring cells. Positions are copied into the
+    // grid's order, so the points of each row of cells are next to each other.
+    collision_grid.build(points.x.data(), points.y.data(), points.z.data(), points.size());
+    auto sorted = collision_grid.sorted_points();
+    sorted_x.resize(sorted.size());
+    sorted_y.resize(sorted.size());
+    sorted_z.resize(sorted.size());
+    for (size_t k = 0; k < sorted.size(); ++k)
+    {
+        sorted_x[k] = points.x[sorted[k]];
+        sorted_y[k] = points.y[sorted[k]];
+        sorted_z[k] = points.z[sorted[k]];
+    }
+
+    // Each pair is found from whichever comes first in the grid's order
+    collision_pairs.clear();
+    for (size_t k = 0; k < sorted.size(); ++k)
+    {
+        float x = sorted_x[k];
+        float y = sorted_y[k];
+        float z = sorted_z[k];
+        int cx = collision_grid.cell_of(0, x);
+        int cy = collision_grid.cell_of(1, y);
+        int cz = collision_grid.cell_of(2, z);
+
+        for (int iy = cy - 1; iy <= cy + 1; ++iy)
+        for (int iz = cz - 1; iz <= cz + 1; ++iz)
+        {
+            auto [first, last] = collision_grid.row(cx - 1, cx + 1, iy, iz);
+            for (size_t l = std::max(first, k + 1); l < last; ++l)
+            {
+                float dx = sorted_x[l] - x;
+                float dy = sorted_y[l] - y;
+                float dz = sorted_z[l] - z;
+                if (dx*dx + dy*dy + dz*dz < DIAMETER*DIAMETER)
+                    collision_pairs.emplace_back(sorted[k], sorted[l]);
+            }
+        }
+    }
+
+    // Push each pair apart until they just touch, sharing 
+    // the distance between them unless one is fixed
+    for (auto [i0, i1] : collision_pairs)
+    {
+        float dx, dy, dz, distance;
+        dx = points.x[i1] - points.x[i0];
+        dy = points.y[i1] - points.y[i0];
+        dz = points.z[i1] - points.z[i0];
+        distance = sqrtf(dx*dx + dy*dy + dz*dz);
+        if (distance >= DIAMETER || distance == 0)
+            continue;
+
+        bool fixed0 = points.fixed[i0];
+        bool fixed1 = points.fixed[i1];
+        if (fixed0 && fixed1)
+            continue;
+        float mult = (DIAMETER - distance) / distance;
+        float share0 = fixed0 ? 0 : fixed1 ? 1 : 0.5f;
+        float share1 = 1 - share0;
+
+        points.x[i0] -= dx * mult * share0;
+        points.y[i0] = std::max(points.y[i0] - dy * mult * share0, FLOOR_HEIGHT);
+        points.z[i0] -= dz * mult * share0;
+        points.x[i1] += dx * mult * share1;
+        points.y[i1] = std::max(points.y[i1] + dy * mult * share1, FLOOR_HEIGHT);
+        points.z[i1] += dz * mult * share1;
+    }
+}
@@ -1,17 +1,62 @@
 #ifndef __VERLET_H_
 #define __VERLET_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
 #include <vector>
+#include "sorted_grid.h"
+#include "spatial_hash.h"
+#include "thread_pool.h"
 
 constexpr int NOT_GRABBED = -1;
 
+// Allocates memory aligned for SIMD loads and stores
+template<typename T, size_t ALIGNMENT = 32>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template<typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, ALIGNMENT>;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, ALIGNMENT>&) {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT)));
+    }
+
+    void deallocate(T* memory, size_t)
+    {
+        ::operator delete(memory, std::align_val_t(ALIGNMENT));
+    }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
 class VerletSystem
 {
-    struct VerletPointMass
+    // Each coordinate of the point masses is kept in its own
+    // array, so several points can be updated at once with SIMD
+    struct VerletPointMasses
     {
-        float x, y, z;
-        float px, py, pz;
-        bool fixed;
+        AlignedVector<float> x, y, z;
+        AlignedVector<float> px, py, pz;
+        AlignedVector<int32_t> fixed; // All bits set if fixed
+
+        size_t size() const { return x.size(); }
     };
 
     struct VerletConstraint
@@ -20,28 +65,61 @@ class VerletSystem
         float ideal_length;
     };
 
-    std::vector<VerletPointMass> points;
+    // Constraints of a colour share no points, so each colour's batch
+    // can be solved in parallel. Points with more constraints than there
+    // are colours put the rest in a last batch that's solved serially.
+    static constexpr unsigned SERIAL_COLOUR = 64;
+
+    VerletPointMasses points;
     std::vector<VerletConstraint> constraints;
+    std::vector<VerletConstraint> coloured_constraints; // Sorted by colour
+    std::vector<size_t> colour_ends;
+    bool constraints_coloured = true;
     std::vector<unsigned> element_array;
     int grabbed_index = NOT_GRABBED;
+    // Rebuilt when next picking a point after any have moved
+    SpatialHash pick_grid;
+    bool pick_grid_valid = false;
+    // Rebuilt every update to find points close enough to collide
+    SortedGrid collision_grid;
+    std::vector<float> sorted_x, sorted_y, sorted_z; // In the grid's order
+    std::vector<std::pair<unsigned, unsigned>> collision_pairs;
+    bool collisions_enabled = true;
+    unsigned thread_count;
+    std::unique_ptr<ThreadPool> thread_pool;
 
 public:
+    // Solves constraints on thread_count threads, or one per core if 0
+    explicit VerletSystem(unsigned thread_count=0);
+
     void add_point(float x, float y, float z, bool fixed=false);
     void add_constraint(unsigned index0, unsigned index1);
     void update();
+    // Whether points push each other apart, which scenes
+    // where they can't meet can turn off to save time
+    void set_collisions(bool enabled);
 
     void update_grabbed_point(float x, float y, float z);
     bool grab_nearby_point(float x, float y, float z);
+    // Grabs the first point the ray from (x, y, z) along (dx, dy, dz)
+    // passes near, up to max_t times the direction's length away
+    bool grab_point_on_ray(float x, float y, float z, 
+                           float dx, float dy, float dz, float max_t);
     void ungrab_point();
 
     void draw_points(auto&& draw) const
     {
-        for (const auto& point : points) draw(point.x, point.y, point.z);
+        for (size_t i = 0; i < points.size(); ++i)
+            draw(points.x[i], points.y[i], points.z[i]);
     }
 
 private:
     void update_point_masses();
+    void colour_constraints();
     void update_constraints();
+    void solve_constraints(size_t begin, size_t end);
+    void collide_points();
+    const SpatialHash& updated_pick_grid();
 };
 
-#endif
\ No newline at end of file
+#endif